@@ -0,0 +1,211 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+#include "atomic_queue.cpp"
+#include "intr_queue.cpp"
+#include "object_pool.cpp"
+#include "static_thread_pool.cpp"
+#include "task_base.hpp"
+
+// Message-driven actors on a StaticThreadPool. Every actor owns a lock-free MPSC mailbox (an AtomicQueue of pooled
+// envelopes) and a count of undelivered messages; the sender that moves the count from 0 to 1 schedules the actor's
+// activation task. An activation delivers at most Budget messages in order, then goes back to the end of the same
+// worker's queue if more are waiting: a busy actor cannot starve the others on its worker, and its state stays in that
+// core's cache while it keeps receiving.
+//
+// Usage: `struct Counter : Actor<Counter, Add> { auto receive(Add& msg) -> void; };` then `counter.send(Add{...})`.
+// receive() of one actor never runs concurrently with itself.
+template <typename Message>
+struct ActorEnvelope {
+  ActorEnvelope* next;
+  Message message;
+};
+
+template <typename Derived, typename Message, std::uint32_t Budget = 64>
+class Actor : private TaskBase {
+public:
+  static_assert(Budget > 0, "Budget > 0");
+  using Envelope = ActorEnvelope<Message>;
+  using EnvelopePool = ObjectPool<Envelope>;
+
+  explicit Actor(StaticThreadPool& pool) noexcept : TaskBase{nullptr, &Actor::activate}, mPool(pool) {}
+  Actor(Actor const&) = delete;
+  Actor& operator=(Actor const&) = delete;
+  // Only destroy an idle actor, or one whose pool has stopped.
+  ~Actor()
+  {
+    while (auto* envelope = mLocal.popFront()) {
+      EnvelopePool::destroy(envelope);
+    }
+    for (auto batch = mMailbox.popAll(); !batch.empty();) {
+      EnvelopePool::destroy(batch.popFront());
+    }
+  }
+
+  // Thread-safe, never blocks; the envelope comes from a per-thread magazine of ObjectPool.
+  template <typename... Args>
+  auto send(Args&&... args) -> void
+  {
+    mMailbox.pushFront(EnvelopePool::create(nullptr, Message((Args &&) args...)));
+    if (mUndelivered.fetch_add(1, std::memory_order_acq_rel) == 0) {
+      schedule();
+    }
+  }
+
+  // No message waiting and no activation scheduled or running.
+  auto idle() const noexcept -> bool { return mUndelivered.load(std::memory_order_acquire) == 0; }
+
+private:
+  // The TaskBase base is the actor's activation, queued at most once at a time. Affinity enqueue would pin actors to
+  // workers too, but most activations deliver a single message and would pay for its steal bookkeeping each time.
+  auto schedule() noexcept -> void { mPool.enqueue(static_cast<TaskBase*>(this)); }
+
+  static auto activate(TaskBase* task, std::uint32_t tid) noexcept -> void { static_cast<Actor*>(task)->deliver(tid); }
+
+  auto deliver(std::uint32_t tid) noexcept -> void
+  {
+    // Only messages already counted: one pushed but not yet counted must wait for the next activation, otherwise the
+    // count could pass through zero while this activation is still queued and its sender would schedule it twice.
+    // Every counted message was pushed before it was counted, so it is in the mailbox or in mLocal.
+    auto const delivered = std::min(Budget, mUndelivered.load(std::memory_order_acquire));
+    for (std::uint32_t i = 0; i < delivered; i++) {
+      if (mLocal.empty()) {
+        // popAll() returns the newest envelope last, i.e. in sending order
+        mLocal = mMailbox.popAll();
+      }
+      auto* envelope = mLocal.popFront();
+      static_cast<Derived*>(this)->receive(envelope->message);
+      EnvelopePool::destroy(envelope);
+    }
+    // whoever sent a message counted here has seen a non-zero count and relies on this activation; after the count
+    // drops to zero the actor may be destroyed
+    if (mUndelivered.fetch_sub(delivered, std::memory_order_acq_rel) != delivered) {
+      mPool.enqueueOn(static_cast<TaskBase*>(this), tid);
+    }
+  }
+
+  StaticThreadPool& mPool;
+  AtomicQueue<&Envelope::next> mMailbox;
+  Queue<&Envelope::next> mLocal; // taken from the mailbox, only touched by the running activation
+  std::atomic_uint32_t mUndelivered{0};
+};
+
+#ifdef ACTOR_MAIN_FUNC
+  #include <cassert>
+  #include <chrono>
+  #include <cstdio>
+  #include <latch>
+  #include <memory>
+  #include <thread>
+  #include <vector>
+
+struct Token {
+  std::uint32_t hopsLeft;
+};
+
+// A ring of actors passing tokens: every hop is one message send and one delivery.
+struct RingNode : Actor<RingNode, Token> {
+  RingNode(StaticThreadPool& pool, std::latch& done) : Actor(pool), done(done) {}
+  auto receive(Token& token) -> void
+  {
+    received += 1;
+    if (token.hopsLeft == 0) {
+      done.count_down();
+      return;
+    }
+    next->send(Token{token.hopsLeft - 1});
+  }
+
+  RingNode* next{nullptr};
+  std::latch& done;
+  std::uint64_t received{0};
+};
+
+struct Add {
+  std::uint32_t producer;
+  std::uint64_t seq;
+};
+
+struct Counter : Actor<Counter, Add> {
+  using Actor::Actor;
+  auto receive(Add& add) -> void
+  {
+    // messages from one sender arrive in sending order
+    assert(lastSeq[add.producer] < add.seq);
+    lastSeq[add.producer] = add.seq;
+    sum += 1;
+  }
+
+  std::uint64_t lastSeq[4]{};
+  std::uint64_t sum{0};
+};
+
+auto main() -> int
+{
+  constexpr auto kActors = 100'000;
+  constexpr auto kTokens = 1000;
+  constexpr auto kHops = 2000;
+  {
+    auto done = std::latch{kTokens};
+    auto nodes = std::vector<std::unique_ptr<RingNode>>{};
+    auto pool = StaticThreadPool(4);
+    for (int i = 0; i < kActors; i++) {
+      nodes.push_back(std::make_unique<RingNode>(pool, done));
+    }
+    for (int i = 0; i < kActors; i++) {
+      nodes[i]->next = nodes[(i + 1) % kActors].get();
+    }
+    auto const start = std::chrono::steady_clock::now();
+    for (int t = 0; t < kTokens; t++) {
+      nodes[static_cast<std::size_t>(t) * (kActors / kTokens)]->send(Token{kHops});
+    }
+    done.wait();
+    auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto messages = std::uint64_t{0};
+    for (auto& node : nodes) {
+      messages += node->received;
+    }
+    assert(messages == std::uint64_t{kTokens} * (kHops + 1));
+    std::printf("ring: %d actors, %llu messages, %.1f M msg/s\n", kActors, (unsigned long long)messages,
+                static_cast<double>(messages) / elapsed / 1e6);
+  }
+
+  constexpr auto kCounters = 1000;
+  constexpr auto kPerProducer = 500'000;
+  {
+    auto pool = StaticThreadPool(4);
+    auto counters = std::vector<std::unique_ptr<Counter>>{};
+    for (int i = 0; i < kCounters; i++) {
+      counters.push_back(std::make_unique<Counter>(pool));
+    }
+    auto const start = std::chrono::steady_clock::now();
+    auto producers = std::vector<std::thread>{};
+    for (std::uint32_t p = 0; p < 4; p++) {
+      producers.emplace_back([&, p] {
+        for (std::uint64_t i = 0; i < kPerProducer; i++) {
+          counters[i % kCounters]->send(Add{p, i + 1});
+        }
+      });
+    }
+    for (auto& producer : producers) {
+      producer.join();
+    }
+    for (auto& counter : counters) {
+      while (!counter->idle()) {
+        std::this_thread::yield();
+      }
+    }
+    auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto total = std::uint64_t{0};
+    for (auto& counter : counters) {
+      total += counter->sum;
+    }
+    assert(total == 4 * kPerProducer);
+    std::printf("fan-in: %d actors, %llu messages from 4 threads, %.1f M msg/s\n", kCounters,
+                (unsigned long long)total, static_cast<double>(total) / elapsed / 1e6);
+  }
+}
+#endif
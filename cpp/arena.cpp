@@ -0,0 +1,461 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "atomic_queue.cpp"
+#include "inplace_function.hpp"
+#include "intr_queue.cpp"
+#include "task_base.hpp"
+
+// Two allocators for request-path objects, both with std allocator and std::pmr adapters:
+//   BumpArena - per-thread monotonic chunks, released all at once by ArenaScope
+//   slab      - size classes served from per-thread free lists, cross-thread frees go to the owner's remote queue
+
+constexpr auto alignUp(std::size_t n, std::size_t align) noexcept -> std::size_t
+{
+  return (n + align - 1) & ~(align - 1);
+}
+
+// Monotonic allocator over a list of chunks. Memory is only given back by rewinding to a mark; chunks are kept and
+// reused, so an arena in steady state does not call the upstream allocator.
+class BumpArena {
+public:
+  static constexpr std::size_t kChunkSize = 64 * 1024;
+
+  struct Mark {
+    void* chunk;
+    std::byte* cursor;
+  };
+
+  BumpArena() noexcept = default;
+  BumpArena(BumpArena const&) = delete;
+  BumpArena& operator=(BumpArena const&) = delete;
+  ~BumpArena()
+  {
+    while (mFirst != nullptr) {
+      auto* chunk = std::exchange(mFirst, mFirst->next);
+      ::operator delete(chunk, std::align_val_t{alignof(std::max_align_t)});
+    }
+  }
+
+  auto allocate(std::size_t size, std::size_t align = alignof(std::max_align_t)) -> void*
+  {
+    auto* p = reinterpret_cast<std::byte*>(alignUp(reinterpret_cast<std::uintptr_t>(mCursor), align));
+    if (mCursor == nullptr || p + size > mEnd) [[unlikely]] {
+      p = refill(size, align);
+    }
+    mCursor = p + size;
+    return p;
+  }
+
+  auto mark() const noexcept -> Mark { return Mark{mCurrent, mCursor}; }
+  // Frees everything allocated after `m`. Objects living there are not destroyed.
+  auto rewind(Mark m) noexcept -> void
+  {
+    mCurrent = static_cast<Chunk*>(m.chunk);
+    mCursor = m.cursor;
+    mEnd = mCurrent != nullptr ? mCurrent->end() : nullptr;
+  }
+  auto reset() noexcept -> void { rewind(Mark{nullptr, nullptr}); }
+
+private:
+  struct Chunk {
+    Chunk* next;
+    std::size_t size;
+
+    auto begin() noexcept -> std::byte* { return reinterpret_cast<std::byte*>(this) + sizeof(Chunk); }
+    auto end() noexcept -> std::byte* { return begin() + size; }
+  };
+
+  // Moves to the next retained chunk that fits, or splices in a new one after the current chunk.
+  [[gnu::noinline]] auto refill(std::size_t size, std::size_t align) -> std::byte*
+  {
+    auto* next = mCurrent != nullptr ? mCurrent->next : mFirst;
+    if (next == nullptr || next->size < size + align) {
+      auto const capacity = std::max(kChunkSize, alignUp(size + align, 4096));
+      auto* chunk = static_cast<Chunk*>(
+          ::operator new(sizeof(Chunk) + capacity, std::align_val_t{alignof(std::max_align_t)}));
+      chunk->next = next;
+      chunk->size = capacity;
+      (mCurrent != nullptr ? mCurrent->next : mFirst) = chunk;
+      next = chunk;
+    }
+    mCurrent = next;
+    mEnd = next->end();
+    return reinterpret_cast<std::byte*>(alignUp(reinterpret_cast<std::uintptr_t>(next->begin()), align));
+  }
+
+  Chunk* mFirst{nullptr};
+  Chunk* mCurrent{nullptr};
+  std::byte* mCursor{nullptr};
+  std::byte* mEnd{nullptr};
+};
+
+inline thread_local BumpArena tBumpArena;
+
+// Rewinds the arena to where it was on entry.
+class ArenaScope {
+public:
+  explicit ArenaScope(BumpArena& arena = tBumpArena) noexcept : mArena(arena), mMark(arena.mark()) {}
+  ArenaScope(ArenaScope const&) = delete;
+  ArenaScope& operator=(ArenaScope const&) = delete;
+  ~ArenaScope() { mArena.rewind(mMark); }
+
+private:
+  BumpArena& mArena;
+  BumpArena::Mark mMark;
+};
+
+// deallocate() is a no-op: objects allocated from it must be gone before their ArenaScope ends.
+template <typename T>
+class ArenaAllocator {
+public:
+  using value_type = T;
+
+  ArenaAllocator(BumpArena& arena = tBumpArena) noexcept : mArena(&arena) {}
+  template <typename U>
+  ArenaAllocator(ArenaAllocator<U> const& other) noexcept : mArena(other.arena())
+  {
+  }
+
+  auto allocate(std::size_t n) -> T* { return static_cast<T*>(mArena->allocate(n * sizeof(T), alignof(T))); }
+  auto deallocate(T*, std::size_t) noexcept -> void {}
+  auto arena() const noexcept -> BumpArena* { return mArena; }
+
+  template <typename U>
+  friend auto operator==(ArenaAllocator const& a, ArenaAllocator<U> const& b) noexcept -> bool
+  {
+    return a.arena() == b.arena();
+  }
+
+private:
+  BumpArena* mArena;
+};
+
+class ArenaResource : public std::pmr::memory_resource {
+public:
+  explicit ArenaResource(BumpArena& arena = tBumpArena) noexcept : mArena(arena) {}
+
+private:
+  auto do_allocate(std::size_t bytes, std::size_t align) -> void* override { return mArena.allocate(bytes, align); }
+  auto do_deallocate(void*, std::size_t, std::size_t) -> void override {}
+  auto do_is_equal(std::pmr::memory_resource const& other) const noexcept -> bool override { return this == &other; }
+
+  BumpArena& mArena;
+};
+
+// Size classes 16..2048 bytes. Blocks are carved from kSlabSize-aligned slabs whose header names the owning heap,
+// so a free on another thread can find the owner and hand the block back through its remote queue.
+constexpr std::size_t kSlabSize = 64 * 1024;
+constexpr std::size_t kSlabMinClass = 16;
+constexpr std::size_t kSlabMaxClass = 2048;
+constexpr std::size_t kSlabMaxAlign = 64;
+constexpr std::size_t kSlabClassCount = std::countr_zero(kSlabMaxClass) - std::countr_zero(kSlabMinClass) + 1;
+
+// kSlabClassCount for allocations the slab does not serve, those go to ::operator new.
+constexpr auto slabClassOf(std::size_t size, std::size_t align) noexcept -> std::size_t
+{
+  size = std::max({size, align, kSlabMinClass});
+  if (size > kSlabMaxClass || align > kSlabMaxAlign) {
+    return kSlabClassCount;
+  }
+  return std::bit_width(size - 1) - std::countr_zero(kSlabMinClass);
+}
+
+class SlabHeap;
+inline auto slabLocalHeap() -> SlabHeap&;
+
+class SlabHeap {
+public:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct alignas(kSlabMaxAlign) SlabHeader {
+    SlabHeap* owner;
+    std::size_t sizeClass;
+  };
+
+  auto allocate(std::size_t sizeClass) -> void*
+  {
+    auto& local = mFree[sizeClass];
+    if (local.empty()) [[unlikely]] {
+      local.append(mRemote[sizeClass].popAll());
+      if (local.empty()) {
+        carve(sizeClass);
+      }
+    }
+    return local.popFront();
+  }
+
+  auto deallocate(void* p) noexcept -> void
+  {
+    auto* header = reinterpret_cast<SlabHeader*>(reinterpret_cast<std::uintptr_t>(p) & ~(kSlabSize - 1));
+    auto* block = ::new (p) FreeBlock{nullptr};
+    if (header->owner == this) {
+      mFree[header->sizeClass].pushFront(block);
+    } else {
+      header->owner->mRemote[header->sizeClass].pushFront(block);
+    }
+  }
+
+private:
+  // deduced return type: SlabHeap is still incomplete in a declaration
+  static auto orphans() noexcept -> auto&
+  {
+    static auto queue = AtomicQueue<&SlabHeap::mNextOrphan>{};
+    return queue;
+  }
+
+public:
+  // Heaps outlive their threads: blocks may still be out on other threads. A new thread adopts an orphan if one is
+  // available, together with its slabs and pending remote frees.
+  static auto acquire() -> SlabHeap*
+  {
+    auto list = orphans().popAll();
+    auto* heap = list.empty() ? new SlabHeap{} : list.popFront();
+    while (!list.empty()) {
+      orphans().pushFront(list.popFront());
+    }
+    return heap;
+  }
+  static auto release(SlabHeap* heap) noexcept -> void { orphans().pushFront(heap); }
+
+private:
+
+  static auto classSize(std::size_t sizeClass) noexcept -> std::size_t { return kSlabMinClass << sizeClass; }
+
+  [[gnu::noinline]] auto carve(std::size_t sizeClass) -> void
+  {
+    auto* slab = static_cast<std::byte*>(::operator new(kSlabSize, std::align_val_t{kSlabSize}));
+    ::new (slab) SlabHeader{this, sizeClass};
+    auto const size = classSize(sizeClass);
+    for (auto* p = slab + sizeof(SlabHeader); p + size <= slab + kSlabSize; p += size) {
+      mFree[sizeClass].pushBack(::new (p) FreeBlock{nullptr});
+    }
+  }
+
+  Queue<&FreeBlock::next> mFree[kSlabClassCount];
+  AtomicQueue<&FreeBlock::next> mRemote[kSlabClassCount];
+  SlabHeap* mNextOrphan{nullptr};
+};
+
+struct SlabHeapHandle {
+  // Once released, the heap may be adopted by another thread at any time; its free lists are not ours anymore.
+  ~SlabHeapHandle()
+  {
+    if (heap != nullptr) {
+      SlabHeap::release(std::exchange(heap, nullptr));
+    }
+    exited = true;
+  }
+
+  SlabHeap* heap{nullptr};
+  bool exited{false};
+};
+
+inline thread_local SlabHeapHandle tSlabHeap;
+
+inline auto slabLocalHeap() -> SlabHeap&
+{
+  if (tSlabHeap.heap == nullptr) [[unlikely]] {
+    tSlabHeap.heap = SlabHeap::acquire();
+  }
+  return *tSlabHeap.heap;
+}
+
+// Runs `f` on this thread's heap. A thread whose SlabHeapHandle is already destroyed (allocating or freeing from
+// another thread_local's destructor) borrows a heap for the one call and puts it straight back on the orphan list.
+template <typename F>
+inline auto slabWithHeap(F&& f) -> decltype(auto)
+{
+  if (tSlabHeap.exited) [[unlikely]] {
+    auto* heap = SlabHeap::acquire();
+    struct Release {
+      ~Release() { SlabHeap::release(heap); }
+      SlabHeap* heap;
+    } release{heap};
+    return f(*heap);
+  }
+  return f(slabLocalHeap());
+}
+
+inline auto slabAllocate(std::size_t size, std::size_t align = alignof(std::max_align_t)) -> void*
+{
+  auto const sizeClass = slabClassOf(size, align);
+  if (sizeClass == kSlabClassCount) [[unlikely]] {
+    return ::operator new(size, std::align_val_t{align});
+  }
+  return slabWithHeap([&](SlabHeap& heap) { return heap.allocate(sizeClass); });
+}
+
+// `size` and `align` must be the ones passed to slabAllocate.
+inline auto slabDeallocate(void* p, std::size_t size, std::size_t align = alignof(std::max_align_t)) noexcept -> void
+{
+  if (slabClassOf(size, align) == kSlabClassCount) [[unlikely]] {
+    ::operator delete(p, size, std::align_val_t{align});
+    return;
+  }
+  slabWithHeap([&](SlabHeap& heap) noexcept { heap.deallocate(p); });
+}
+
+template <typename T>
+class SlabAllocator {
+public:
+  using value_type = T;
+
+  SlabAllocator() noexcept = default;
+  template <typename U>
+  SlabAllocator(SlabAllocator<U> const&) noexcept
+  {
+  }
+
+  auto allocate(std::size_t n) -> T* { return static_cast<T*>(slabAllocate(n * sizeof(T), alignof(T))); }
+  auto deallocate(T* p, std::size_t n) noexcept -> void { slabDeallocate(p, n * sizeof(T), alignof(T)); }
+
+  template <typename U>
+  friend auto operator==(SlabAllocator const&, SlabAllocator<U> const&) noexcept -> bool
+  {
+    return true;
+  }
+};
+
+class SlabResource : public std::pmr::memory_resource {
+public:
+  static auto instance() noexcept -> SlabResource*
+  {
+    static auto resource = SlabResource{};
+    return &resource;
+  }
+
+private:
+  auto do_allocate(std::size_t bytes, std::size_t align) -> void* override { return slabAllocate(bytes, align); }
+  auto do_deallocate(void* p, std::size_t bytes, std::size_t align) -> void override
+  {
+    slabDeallocate(p, bytes, align);
+  }
+  auto do_is_equal(std::pmr::memory_resource const& other) const noexcept -> bool override
+  {
+    return dynamic_cast<SlabResource const*>(&other) != nullptr;
+  }
+};
+
+// Routes `new Derived(...)` / `delete` through the slab, e.g. `struct Task : TaskBase, SlabAllocated<Task>`.
+template <typename Derived>
+struct SlabAllocated {
+  static auto operator new(std::size_t size) -> void* { return slabAllocate(size, alignof(Derived)); }
+  static auto operator delete(void* p, std::size_t size) noexcept -> void
+  {
+    slabDeallocate(p, size, alignof(Derived));
+  }
+};
+
+// Fire-and-forget pool task carrying its callable, allocated from the slab and freed by the worker that runs it:
+// `pool.enqueue(makeSlabTask([=] { ... }))`. The callable takes either nothing or the worker id.
+template <typename Fn>
+class SlabTask : public TaskBase, public SlabAllocated<SlabTask<Fn>> {
+public:
+  explicit SlabTask(Fn fn) : TaskBase{nullptr, &SlabTask::run}, mFn(std::move(fn)) {}
+
+private:
+  static auto run(TaskBase* task, std::uint32_t tid) noexcept -> void
+  {
+    auto* self = static_cast<SlabTask*>(task);
+    self->mFn(tid);
+    delete self;
+  }
+
+  Fn mFn;
+};
+
+template <typename F>
+auto makeSlabTask(F&& f) -> TaskBase*
+{
+  using Fn = std::decay_t<decltype(withWorkerId((F &&) f))>;
+  return new SlabTask<Fn>(withWorkerId((F &&) f));
+}
+
+#ifdef ARENA_MAIN_FUNC
+  #include "fiber.hpp"
+  #include <array>
+  #include "intr_ptr.cpp"
+  #include "static_thread_pool.cpp"
+  #include <cstdio>
+  #include <thread>
+  #include <vector>
+
+auto finished = std::atomic_int{0};
+
+struct FiberState {
+  FiberHandle self;
+  FiberHandle caller;
+  int count;
+};
+
+auto fiberBody(void* arg) -> void
+{
+  auto* state = static_cast<FiberState*>(arg);
+  state->count += 1;
+  switchFiber(state->self, state->caller);
+}
+
+auto main() -> int
+{
+  {
+    auto scope = ArenaScope{};
+    auto* a = static_cast<int*>(tBumpArena.allocate(sizeof(int), alignof(int)));
+    auto resource = ArenaResource{};
+    auto vec = std::pmr::vector<int>(&resource);
+    vec.assign(1000, 3);
+    *a = 1;
+    auto p = allocateIntr<int, LocalRefCount>(ArenaAllocator<int>{}, 42);
+    assert(*p == 42);
+  }
+  auto const m = tBumpArena.mark();
+  tBumpArena.allocate(200'000); // larger than a chunk
+  tBumpArena.rewind(m);
+
+  auto slabPtr = allocateIntr<std::uint64_t>(SlabAllocator<std::uint64_t>{}, 7u);
+  auto copy = slabPtr;
+  std::thread([p = std::move(slabPtr)]() mutable { p.reset(); }).join();
+  assert(*copy == 7);
+  copy.reset();
+
+  auto* resource = SlabResource::instance();
+  auto strings = std::pmr::vector<std::pmr::string>(resource);
+  for (int i = 0; i < 1000; i++) {
+    strings.emplace_back("a string long enough to leave the small buffer");
+  }
+
+  {
+    auto pool = StaticThreadPool(4);
+    for (int round = 0; round < 10; round++) {
+      for (int i = 0; i < 10'000; i++) {
+        // freed on whichever worker ran it, usually not the allocating thread
+        pool.enqueue(makeSlabTask([payload = std::array<std::uint64_t, 4>{}] {
+          finished.fetch_add(1, std::memory_order_release);
+        }));
+      }
+      while (finished.load(std::memory_order_acquire) != (round + 1) * 10'000) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  auto state = FiberState{nullptr, createFiberFromThread(), 0};
+  state.self = createFiber(16 * 1024, fiberBody, &state, resource);
+  switchFiber(state.caller, state.self);
+  assert(state.count == 1);
+  destroyFiber(state.self, resource);
+  destroyFiber(state.caller, free);
+  std::puts("ok");
+}
+#endif
@@ -0,0 +1,214 @@
+#pragma once
+#include "intr_ptr.cpp"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+// An IntrPtr slot that many threads can load/store concurrently without a lock.
+//
+// The slot packs the control block pointer with a 16-bit "claimed" counter. Every store pre-pays kReserve references
+// on the block, a reader takes one of them with a single fetch_add on the slot and never touches the block's count.
+// Readers top the reservation up once half of it is claimed; the writer that swaps a block out returns the unclaimed
+// part. Only AtomicRefCount blocks can be published this way.
+template <typename T>
+class AtomicIntrPtr {
+  static_assert(sizeof(void*) == 8, "pointer and claim counter share one 64-bit word");
+
+public:
+  using value_type = IntrPtr<T>;
+
+  AtomicIntrPtr() noexcept = default;
+  explicit AtomicIntrPtr(IntrPtr<T> ptr) noexcept : mWord(pack(reserve(std::exchange(ptr.mData, nullptr)))) {}
+  AtomicIntrPtr(AtomicIntrPtr const&) = delete;
+  AtomicIntrPtr& operator=(AtomicIntrPtr const&) = delete;
+  ~AtomicIntrPtr() noexcept
+  {
+    auto const word = mWord.load(std::memory_order_relaxed);
+    unreserve(blockOf(word), claimedOf(word));
+  }
+
+  auto isLockFree() const noexcept -> bool { return mWord.is_always_lock_free; }
+
+  auto load() noexcept -> IntrPtr<T>
+  {
+    if (blockOf(mWord.load(std::memory_order_relaxed)) == nullptr) {
+      return IntrPtr<T>{};
+    }
+    auto word = mWord.fetch_add(kOneClaim, std::memory_order_acquire) + kOneClaim;
+    auto* block = blockOf(word);
+    if (block == nullptr) {
+      // raced with a store of nullptr, an empty slot owns nothing so just give the claim back
+      while (blockOf(word) == nullptr && !mWord.compare_exchange_weak(word, word - kOneClaim)) {
+      }
+      return IntrPtr<T>{};
+    }
+    if (claimedOf(word) >= kReserve / 2) {
+      refill(word);
+    }
+    auto ptr = IntrPtr<T>{};
+    ptr.mData = block;
+    return ptr;
+  }
+
+  auto store(IntrPtr<T> desired) noexcept -> void { exchange(std::move(desired)); }
+
+  auto exchange(IntrPtr<T> desired) noexcept -> IntrPtr<T>
+  {
+    auto const old = mWord.exchange(pack(reserve(std::exchange(desired.mData, nullptr))), std::memory_order_acq_rel);
+    return settle(old);
+  }
+
+  // Replaces the slot with `desired` if it still holds expected's object; otherwise loads the current one into
+  // `expected`. Like std::atomic, `desired` is consumed only on success.
+  auto compareExchange(IntrPtr<T>& expected, IntrPtr<T>& desired) noexcept -> bool
+  {
+    auto* const next = reserve(desired.mData);
+    auto word = mWord.load(std::memory_order_relaxed);
+    while (blockOf(word) == expected.mData) {
+      if (mWord.compare_exchange_weak(word, pack(next), std::memory_order_acq_rel)) {
+        desired.mData = nullptr;
+        [[maybe_unused]] auto old = settle(word);
+        return true;
+      }
+    }
+    unreserve(next, 1);
+    expected = load();
+    return false;
+  }
+
+private:
+  using Block = ControlBlock<std::remove_cv_t<T>, AtomicRefCount>;
+
+  static constexpr int kClaimShift = 48;
+  static constexpr std::uint64_t kPointerMask = (std::uint64_t{1} << kClaimShift) - 1;
+  static constexpr std::uint64_t kOneClaim = std::uint64_t{1} << kClaimShift;
+  static constexpr std::uint64_t kReserve = 1 << 15;
+
+  static auto pack(Block* block) noexcept -> std::uint64_t
+  {
+    auto const bits = reinterpret_cast<std::uintptr_t>(block);
+    assert((bits & ~kPointerMask) == 0 && "user-space pointers fit in 48 bits");
+    return bits;
+  }
+  static auto blockOf(std::uint64_t word) noexcept -> Block*
+  {
+    return reinterpret_cast<Block*>(static_cast<std::uintptr_t>(word & kPointerMask));
+  }
+  static auto claimedOf(std::uint64_t word) noexcept -> std::uint64_t { return word >> kClaimShift; }
+
+  // Turns the single reference owned by an IntrPtr into the slot's reservation.
+  static auto reserve(Block* block) noexcept -> Block*
+  {
+    if (block != nullptr) {
+      block->mRefCount.mCount.fetch_add(kReserve - 1, std::memory_order_relaxed);
+    }
+    return block;
+  }
+
+  // Drops what is left of a reservation after `claimed` references were handed out.
+  static auto unreserve(Block* block, std::uint64_t claimed) noexcept -> void
+  {
+    if (block == nullptr) {
+      return;
+    }
+    auto const count = kReserve - claimed;
+    if (block->mRefCount.mCount.fetch_sub(count, std::memory_order_release) == count) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      block->dispose();
+    }
+  }
+
+  // Converts a swapped-out slot word into one plain reference.
+  static auto settle(std::uint64_t word) noexcept -> IntrPtr<T>
+  {
+    auto* block = blockOf(word);
+    auto ptr = IntrPtr<T>{};
+    if (block != nullptr) {
+      auto const extra = kReserve - claimedOf(word) - 1;
+      block->mRefCount.mCount.fetch_sub(extra, std::memory_order_relaxed);
+      ptr.mData = block;
+    }
+    return ptr;
+  }
+
+  // Pays for the claims taken so far and winds the counter back. A word that changed under us (even to the same
+  // block) is fine: refs and counter move together, and our own claim keeps the block alive if we must undo.
+  auto refill(std::uint64_t word) noexcept -> void
+  {
+    auto* block = blockOf(word);
+    auto const claimed = claimedOf(word);
+    block->mRefCount.mCount.fetch_add(claimed, std::memory_order_relaxed);
+    while (blockOf(word) == block && claimedOf(word) >= claimed) {
+      // release: a writer whose exchange reads this word settles the reservation, so it must see the fetch_add above
+      if (mWord.compare_exchange_weak(word, word - claimed * kOneClaim, std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+        return;
+      }
+    }
+    block->mRefCount.mCount.fetch_sub(claimed, std::memory_order_relaxed);
+  }
+
+  std::atomic<std::uint64_t> mWord{0};
+};
+
+#ifdef ATOMIC_INTR_PTR_MAIN_FUNC
+  #include <thread>
+  #include <vector>
+
+constexpr auto kReaders = 8;
+constexpr auto kWriters = 2;
+constexpr auto kIterations = 200'000;
+
+auto alive = std::atomic_int{0};
+struct Config {
+  Config(int v) : version(v), check(v * 3) { alive.fetch_add(1, std::memory_order_relaxed); }
+  ~Config() { alive.fetch_sub(1, std::memory_order_relaxed); }
+  int version;
+  int check;
+};
+
+auto main() -> int
+{
+  {
+    auto current = AtomicIntrPtr<Config>{makeIntr<Config>(0)};
+    assert(current.isLockFree());
+    auto threads = std::vector<std::thread>{};
+    for (int i = 0; i < kReaders; i++) {
+      threads.emplace_back([&] {
+        for (int j = 0; j < kIterations; j++) {
+          auto config = current.load();
+          assert((*config).check == (*config).version * 3);
+        }
+      });
+    }
+    for (int i = 0; i < kWriters; i++) {
+      threads.emplace_back([&, i] {
+        for (int j = 0; j < kIterations / 10; j++) {
+          if (j % 2 == 0) {
+            current.store(makeIntr<Config>(i * kIterations + j));
+          } else {
+            auto expected = current.load();
+            auto desired = makeIntr<Config>((*expected).version + 1);
+            while (!current.compareExchange(expected, desired)) {
+            }
+            assert(!desired);
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    assert(alive.load() == 1);
+    current.store(IntrPtr<Config>{});
+    assert(alive.load() == 0);
+    assert(!current.load());
+
+    auto other = AtomicIntrPtr<Config>{makeIntr<Config>(1)};
+    auto copy = other.load();
+    assert(alive.load() == 1);
+  }
+  assert(alive.load() == 0);
+}
+#endif
@@ -1,5 +1,8 @@
+#pragma once
 #include "intr_queue.cpp"
 #include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <thread>
 #include <vector>
 
@@ -29,7 +32,63 @@ public:
 private:
   atomic_node_pointer mHead{nullptr};
 };
-#define INTR_ATOMIC_QUEUE_MAIN_FUNC
+template <auto next>
+class TaggedAtomicStack;
+
+// Lock-free LIFO that can pop single nodes. The head word packs the node pointer with a 16-bit tag bumped on every
+// change, so a pop that raced with pop/push/pop of the same node fails its CAS instead of corrupting the list. Nodes
+// must stay readable while the stack is in use (recycled, never freed), a losing pop may still load their `next`.
+template <typename Item, Item* Item::*next>
+class TaggedAtomicStack<next> {
+public:
+  using node_pointer = Item*;
+
+  auto empty() const noexcept -> bool { return nodeOf(mHead.load(std::memory_order_relaxed)) == nullptr; }
+  auto pushFront(node_pointer t) noexcept -> void
+  {
+    auto word = mHead.load(std::memory_order_relaxed);
+    do {
+      std::atomic_ref(t->*next).store(nodeOf(word), std::memory_order_relaxed);
+    } while (!mHead.compare_exchange_weak(word, pack(t, word), std::memory_order_release, std::memory_order_relaxed));
+  }
+  auto popFront() noexcept -> node_pointer
+  {
+    auto word = mHead.load(std::memory_order_acquire);
+    while (auto* node = nodeOf(word)) {
+      // atomic: `node` may already have been popped and pushed again by another thread, the tag rejects the CAS then
+      auto const successor = std::atomic_ref(node->*next).load(std::memory_order_relaxed);
+      if (mHead.compare_exchange_weak(word, pack(successor, word), std::memory_order_acquire)) {
+        return node;
+      }
+    }
+    return nullptr;
+  }
+  auto popAll() noexcept -> Queue<next>
+  {
+    auto word = mHead.load(std::memory_order_relaxed);
+    while (!mHead.compare_exchange_weak(word, pack(nullptr, word), std::memory_order_acq_rel)) {
+    }
+    return Queue<next>::from(nodeOf(word));
+  }
+
+private:
+  static constexpr int kTagShift = 48;
+  static constexpr std::uint64_t kPointerMask = (std::uint64_t{1} << kTagShift) - 1;
+
+  static auto pack(node_pointer node, std::uint64_t prev) noexcept -> std::uint64_t
+  {
+    auto const bits = reinterpret_cast<std::uintptr_t>(node);
+    assert((bits & ~kPointerMask) == 0 && "user-space pointers fit in 48 bits");
+    return bits | (((prev >> kTagShift) + 1) << kTagShift);
+  }
+  static auto nodeOf(std::uint64_t word) noexcept -> node_pointer
+  {
+    return reinterpret_cast<node_pointer>(static_cast<std::uintptr_t>(word & kPointerMask));
+  }
+
+  std::atomic<std::uint64_t> mHead{0};
+};
+
 #ifdef INTR_ATOMIC_QUEUE_MAIN_FUNC
 
   #include <iostream>
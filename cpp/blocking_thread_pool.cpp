@@ -5,14 +5,12 @@
 #include <thread>
 
 #include "intr_queue.cpp"
+#include "perf_counters.hpp"
+#include "task_base.hpp"
+#include "trace.hpp"
 
 #include <iostream>
 
-struct TaskBase {
-  TaskBase* next;
-  void (*run)(TaskBase* task, std::uint32_t tid) noexcept;
-};
-
 class BlockingThreadPool {
 public:
   BlockingThreadPool(std::size_t threadLimit) : mIdleCount(0), mThreadCount(0), mThreadLimits(threadLimit) {}
@@ -37,7 +35,11 @@ private:
         growPool();
         auto task = mQueue.popFront();
         lk.unlock();
-        task->run(task, 0);
+        {
+          auto span = TraceSpan{kTraceTask};
+          auto perf = PerfScope{task->run};
+          task->run(task, 0);
+        }
         lk.lock();
       }
       mIdleCount += 1;
@@ -62,6 +64,8 @@ private:
   }
 
 private:
+  static constexpr auto kTraceTask = TraceSite{"task", "BlockingThreadPool"};
+
   std::mutex mQueueMt;
   std::condition_variable mQueueCv;
   Queue<&TaskBase::next> mQueue;
@@ -0,0 +1,6 @@
+#pragma once
+#include <cstdint>
+
+// Handle of the fiber running on this thread as an integer, 0 on the thread's own context. Kept up to date by
+// switchFiber(), reported by crash dumps.
+inline thread_local std::uint64_t tCurrentFiberId = 0;
@@ -22,6 +22,11 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <memory_resource>
+#include <new>
+
+#include "current_fiber.hpp"
+#include "trace.hpp"
 
 using Reg = std::uint64_t;
 static_assert(sizeof(Reg) == 8, "Reg must be 64-bit");
@@ -190,6 +195,34 @@ inline auto createFiber(std::uint32_t stackSize, auto (*target)(void*)->void, vo
   return fiber;
 }
 
+// Same as above, but the Fiber and its stack both come from `resource`; release it with the matching destroyFiber.
+inline auto createFiber(std::uint32_t stackSize, auto (*target)(void*)->void, void* arg,
+                        std::pmr::memory_resource* resource) -> FiberHandle
+{
+  if (stackSize == 0 || target == nullptr || arg == nullptr || resource == nullptr) {
+    return nullptr;
+  }
+
+  Fiber* fiber = ::new (resource->allocate(sizeof(Fiber), alignof(Fiber))) Fiber{};
+
+#if defined(MY_FIBER_ASM_IMPL)
+  fiber->stackPtr = resource->allocate(stackSize, MY_FIBER_STACK_ALIGNMENT);
+  fiber->stackSize = stackSize;
+
+  if (!_createFiberInternal(fiber->stackPtr, stackSize, target, arg, &fiber->context)) {
+    resource->deallocate(fiber->stackPtr, stackSize, MY_FIBER_STACK_ALIGNMENT);
+    resource->deallocate(fiber, sizeof(Fiber), alignof(Fiber));
+    return nullptr;
+  }
+
+#elif defined(MY_FIBER_WIN)
+  fiber->context.rawFiberHandle = ::CreateFiber(stackSize, target, arg);
+  fiber->fromThread = false;
+#endif
+
+  return fiber;
+}
+
 inline auto createFiberFromThread() -> FiberHandle
 {
   Fiber* fiber = new Fiber;
@@ -207,8 +240,17 @@ inline auto createFiberFromThread() -> FiberHandle
   return fiber;
 }
 
+inline constexpr auto kTraceFiberSwitch = TraceSite{"switch", "fiber"};
+
 inline void switchFiber(FiberHandle from, FiberHandle const to)
 {
+  traceInstant(kTraceFiberSwitch, reinterpret_cast<std::uintptr_t>(to));
+#if defined(MY_FIBER_ASM_IMPL)
+  auto const toThread = to->stackPtr == nullptr;
+#elif defined(MY_FIBER_WIN)
+  auto const toThread = to->fromThread;
+#endif
+  tCurrentFiberId = toThread ? 0 : reinterpret_cast<std::uintptr_t>(to);
 #if defined(MY_FIBER_ASM_IMPL)
   _switch_fiber_internal(&from->context, &to->context);
 #elif defined(MY_FIBER_WIN)
@@ -241,8 +283,30 @@ inline void destroyFiber(FiberHandle fiber, auto (*stackDealloc)(void*)->void)
   delete fiber;
 }
 
-#include <cstdlib>
-#include <iostream>
+inline void destroyFiber(FiberHandle fiber, std::pmr::memory_resource* resource)
+{
+  if (fiber == nullptr || resource == nullptr) {
+    return;
+  }
+
+#if defined(MY_FIBER_ASM_IMPL)
+  if (fiber->stackPtr != nullptr) {
+    resource->deallocate(fiber->stackPtr, fiber->stackSize, MY_FIBER_STACK_ALIGNMENT);
+    fiber->stackPtr = nullptr;
+  }
+
+#elif defined(MY_FIBER_WIN)
+  ::DeleteFiber(fiber->context.rawFiberHandle);
+  fiber->context.rawFiberHandle = nullptr;
+#endif
+
+  resource->deallocate(fiber, sizeof(Fiber), alignof(Fiber));
+}
+
+#ifdef FIBER_MAIN_FUNC
+  #include <cassert>
+  #include <cstdlib>
+  #include <iostream>
 
 // #include "tiny_fiber.h"
 FiberHandle thread_fiber;
@@ -252,6 +316,7 @@ void fibermain(void* arg)
 {
   FiberHandle fiber = *reinterpret_cast<FiberHandle*>(arg);
   std::cout << "hello fiber " << std::endl;
+  assert(tCurrentFiberId == reinterpret_cast<std::uintptr_t>(fiber));
   switchFiber(fiber, thread_fiber);
 }
 
@@ -261,9 +326,11 @@ int main(int argc, char** argv)
   thread_fiber = createFiberFromThread(); // this thread context
   fiber = createFiber(stack_size, fibermain, &fiber, ::aligned_alloc);
   switchFiber(thread_fiber, fiber);
+  assert(tCurrentFiberId == 0);
   ::puts("hooray!");
 
   destroyFiber(fiber, free);
   destroyFiber(thread_fiber, free);
   return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -7,7 +7,7 @@
 #include <span>
 #include <vector>
 
-template <class T, class IdType = uint32_t>
+template <class T, class IdType = uint32_t, class Alloc = std::allocator<T>>
   requires std::is_swappable_v<T>
 class DenseSlab;
 
@@ -21,30 +21,34 @@ class DenseSlabBase {
 
   auto Empty() const -> bool { return Size() == 0; }
 
-  template <typename T>
-  auto GetDenseSlab() -> DenseSlab<T, IdType> & {
-    return dynamic_cast<DenseSlab<T, IdType> &>(*this);
+  template <typename T, class Alloc = std::allocator<T>>
+  auto GetDenseSlab() -> DenseSlab<T, IdType, Alloc> & {
+    return dynamic_cast<DenseSlab<T, IdType, Alloc> &>(*this);
   }
 
-  template <typename T>
-  auto GetDenseSlab() const -> DenseSlab<T, IdType> const & {
-    return dynamic_cast<DenseSlab<T, IdType> const &>(*this);
+  template <typename T, class Alloc = std::allocator<T>>
+  auto GetDenseSlab() const -> DenseSlab<T, IdType, Alloc> const & {
+    return dynamic_cast<DenseSlab<T, IdType, Alloc> const &>(*this);
   }
 
-  template <typename T>
+  template <typename T, class Alloc = std::allocator<T>>
   auto Get(IdType index) -> T & {
-    return GetDenseSlab<T>().Get(index);
+    return GetDenseSlab<T, Alloc>().Get(index);
   }
 
-  template <typename T>
+  template <typename T, class Alloc = std::allocator<T>>
   auto Get(IdType index) const -> T const & {
-    return GetDenseSlab<T>().Get(index);
+    return GetDenseSlab<T, Alloc>().Get(index);
   }
 };
 
-template <class T, class IdType>
+// Storage for the items and the lookup table comes from Alloc (rebound), e.g. HugePageAllocator for large slabs.
+template <class T, class IdType, class Alloc>
   requires std::is_swappable_v<T>
 class DenseSlab : public DenseSlabBase<IdType> {
+  template <class U>
+  using Rebind = typename std::allocator_traits<Alloc>::template rebind_alloc<U>;
+
  public:
   struct Item {
     explicit Item(uint32_t idx) : look_up_idx_(idx) {}
@@ -73,7 +77,8 @@ class DenseSlab : public DenseSlabBase<IdType> {
 
   DenseSlab() = default;
 
-  explicit DenseSlab(size_t capacity) {
+  explicit DenseSlab(size_t capacity, Alloc const &alloc = Alloc{})
+      : data_(Rebind<Item>(alloc)), look_up_(Rebind<uint32_t>(alloc)) {
     data_.reserve(capacity);
     look_up_.reserve(capacity);
   }
@@ -151,10 +156,12 @@ class DenseSlab : public DenseSlabBase<IdType> {
   }
 
   size_t len_{0};
-  std::vector<Item> data_;
-  std::vector<uint32_t> look_up_;
+  std::vector<Item, Rebind<Item>> data_;
+  std::vector<uint32_t, Rebind<uint32_t>> look_up_;
 };
 
+#ifdef FREELIST_MAIN_FUNC
+
 struct MyId {
   MyId(uint32_t id) : id_(id) {}
 
@@ -263,3 +270,4 @@ void InsertGetRemoveAll() {
 }
 
 auto main(int argc, char *argv[]) -> int { InsertGetRemoveAll(); }
+#endif
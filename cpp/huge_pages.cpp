@@ -0,0 +1,313 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <tuple>
+#include <utility>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Memory regions backed by 2 MiB pages where the system allows it. A region first tries an explicit hugetlbfs
+// mapping (MAP_HUGETLB, needs pages reserved in /proc/sys/vm/nr_hugepages), then a 2 MiB-aligned anonymous mapping
+// with madvise(MADV_HUGEPAGE) for transparent huge pages, and otherwise keeps the plain mapping. hugePageStats()
+// counts how many bytes were mapped with each outcome.
+
+constexpr std::size_t kHugePageSize = std::size_t{2} << 20;
+
+enum class HugePageKind : std::uint8_t {
+  HugeTlb,     // explicit huge pages, guaranteed
+  Transparent, // THP requested; the kernel may still back parts with 4K pages, see transparentHugeBytes()
+  Normal,      // plain 4K pages
+};
+
+// Totals since start, per outcome, plus what is mapped right now.
+struct HugePageStats {
+  std::uint64_t hugeTlbBytes;
+  std::uint64_t transparentBytes;
+  std::uint64_t normalBytes;
+  std::uint64_t liveBytes;
+};
+
+struct HugePageCounters {
+  std::atomic<std::uint64_t> bytes[3]{};
+  std::atomic<std::uint64_t> liveBytes{0};
+};
+
+inline constinit HugePageCounters gHugePageCounters{};
+
+inline auto hugePageStats() noexcept -> HugePageStats
+{
+  auto const& c = gHugePageCounters;
+  return HugePageStats{c.bytes[0].load(std::memory_order_relaxed), c.bytes[1].load(std::memory_order_relaxed),
+                       c.bytes[2].load(std::memory_order_relaxed), c.liveBytes.load(std::memory_order_relaxed)};
+}
+
+// AnonHugePages of the mapping containing `addr`, from /proc/self/smaps: how much of a Transparent region the kernel
+// actually backs with huge pages right now. Slow, meant for reports.
+inline auto transparentHugeBytes(void const* addr) -> std::uint64_t
+{
+  auto* file = std::fopen("/proc/self/smaps", "r");
+  if (file == nullptr) {
+    return 0;
+  }
+  auto const target = reinterpret_cast<std::uintptr_t>(addr);
+  auto inside = false;
+  auto result = std::uint64_t{0};
+  char line[512];
+  while (std::fgets(line, sizeof(line), file) != nullptr) {
+    unsigned long begin = 0;
+    unsigned long end = 0;
+    if (std::sscanf(line, "%lx-%lx ", &begin, &end) == 2 && std::strchr(line, ':') > std::strchr(line, ' ')) {
+      inside = begin <= target && target < end;
+      continue;
+    }
+    unsigned long kb = 0;
+    if (inside && std::sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+      result = std::uint64_t{kb} * 1024;
+      break;
+    }
+  }
+  std::fclose(file);
+  return result;
+}
+
+inline auto hugePageRoundUp(std::size_t bytes) noexcept -> std::size_t
+{
+  return (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+class HugePageRegion {
+public:
+  HugePageRegion() noexcept = default;
+  // Maps at least `bytes`, rounded up to whole huge pages. Throws std::bad_alloc when even plain pages fail.
+  explicit HugePageRegion(std::size_t bytes) : mSize(hugePageRoundUp(bytes))
+  {
+    std::tie(mData, mKind) = map(mSize);
+  }
+  HugePageRegion(HugePageRegion&& other) noexcept
+      : mData(std::exchange(other.mData, nullptr)), mSize(std::exchange(other.mSize, 0)), mKind(other.mKind)
+  {
+  }
+  HugePageRegion& operator=(HugePageRegion&& other) noexcept
+  {
+    if (this != &other) {
+      unmap(std::exchange(mData, std::exchange(other.mData, nullptr)), std::exchange(mSize, other.mSize));
+      mKind = other.mKind;
+      other.mSize = 0;
+    }
+    return *this;
+  }
+  ~HugePageRegion() { unmap(mData, mSize); }
+
+  auto data() const noexcept -> void* { return mData; }
+  auto size() const noexcept -> std::size_t { return mSize; }
+  auto kind() const noexcept -> HugePageKind { return mKind; }
+
+  // `size` must already be a multiple of kHugePageSize.
+  static auto map(std::size_t size) -> std::pair<void*, HugePageKind>
+  {
+    auto kind = HugePageKind::HugeTlb;
+    auto* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      p = mapAligned(size);
+      kind = ::madvise(p, size, MADV_HUGEPAGE) == 0 ? HugePageKind::Transparent : HugePageKind::Normal;
+    }
+    auto& counters = gHugePageCounters;
+    counters.bytes[static_cast<int>(kind)].fetch_add(size, std::memory_order_relaxed);
+    counters.liveBytes.fetch_add(size, std::memory_order_relaxed);
+    return {p, kind};
+  }
+
+  static auto unmap(void* p, std::size_t size) noexcept -> void
+  {
+    if (p == nullptr) {
+      return;
+    }
+    ::munmap(p, size);
+    gHugePageCounters.liveBytes.fetch_sub(size, std::memory_order_relaxed);
+  }
+
+private:
+  // THP only applies to 2 MiB-aligned ranges: over-map by one huge page and trim both ends.
+  static auto mapAligned(std::size_t size) -> void*
+  {
+    auto* raw = ::mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+      throw std::bad_alloc{};
+    }
+    auto const begin = reinterpret_cast<std::uintptr_t>(raw);
+    auto const aligned = hugePageRoundUp(begin);
+    if (aligned != begin) {
+      ::munmap(raw, aligned - begin);
+    }
+    if (auto const tail = begin + kHugePageSize - aligned; tail != 0) {
+      ::munmap(reinterpret_cast<void*>(aligned + size), tail);
+    }
+    return reinterpret_cast<void*>(aligned);
+  }
+
+  void* mData{nullptr};
+  std::size_t mSize{0};
+  HugePageKind mKind{HugePageKind::Normal};
+};
+
+// Every allocation of at least half a huge page gets its own region, smaller ones go to ::operator new where a huge
+// page would mostly be waste. Meant for big, long-lived buffers: FIFO rings, slab storage.
+template <typename T>
+class HugePageAllocator {
+public:
+  using value_type = T;
+
+  HugePageAllocator() noexcept = default;
+  template <typename U>
+  HugePageAllocator(HugePageAllocator<U> const&) noexcept
+  {
+  }
+
+  auto allocate(std::size_t n) -> T*
+  {
+    auto const bytes = n * sizeof(T);
+    if (bytes < kHugePageSize / 2) {
+      return static_cast<T*>(::operator new(bytes, std::align_val_t{alignof(T)}));
+    }
+    return static_cast<T*>(HugePageRegion::map(hugePageRoundUp(bytes)).first);
+  }
+  auto deallocate(T* p, std::size_t n) noexcept -> void
+  {
+    auto const bytes = n * sizeof(T);
+    if (bytes < kHugePageSize / 2) {
+      ::operator delete(p, std::align_val_t{alignof(T)});
+      return;
+    }
+    HugePageRegion::unmap(p, hugePageRoundUp(bytes));
+  }
+
+  template <typename U>
+  friend auto operator==(HugePageAllocator const&, HugePageAllocator<U> const&) noexcept -> bool
+  {
+    return true;
+  }
+};
+
+// pmr resource with HugePageAllocator's policy: requests of half a huge page or more map their own region.
+class HugePageResource : public std::pmr::memory_resource {
+private:
+  auto do_allocate(std::size_t bytes, std::size_t align) -> void* override
+  {
+    if (bytes < kHugePageSize / 2) {
+      return ::operator new(bytes, std::align_val_t{align});
+    }
+    return HugePageRegion::map(hugePageRoundUp(bytes)).first;
+  }
+  auto do_deallocate(void* p, std::size_t bytes, std::size_t align) -> void override
+  {
+    if (bytes < kHugePageSize / 2) {
+      ::operator delete(p, std::align_val_t{align});
+      return;
+    }
+    HugePageRegion::unmap(p, hugePageRoundUp(bytes));
+  }
+  auto do_is_equal(std::pmr::memory_resource const& other) const noexcept -> bool override
+  {
+    return dynamic_cast<HugePageResource const*>(&other) != nullptr;
+  }
+};
+
+inline auto hugePageResource() noexcept -> HugePageResource*
+{
+  static auto resource = HugePageResource{};
+  return &resource;
+}
+
+// Fiber stacks packed into huge-page regions (pass it to createFiber/destroyFiber). Freed stacks are recycled by a
+// pool, the regions themselves are released with the resource.
+class HugePageStackResource : public std::pmr::memory_resource {
+public:
+  explicit HugePageStackResource(std::size_t stackSize)
+      : mRegions(kHugePageSize, hugePageResource()),
+        mStacks(std::pmr::pool_options{.max_blocks_per_chunk = std::max<std::size_t>(1, kHugePageSize / stackSize),
+                                       .largest_required_pool_block = stackSize},
+                &mRegions)
+  {
+  }
+
+private:
+  auto do_allocate(std::size_t bytes, std::size_t align) -> void* override { return mStacks.allocate(bytes, align); }
+  auto do_deallocate(void* p, std::size_t bytes, std::size_t align) -> void override
+  {
+    mStacks.deallocate(p, bytes, align);
+  }
+  auto do_is_equal(std::pmr::memory_resource const& other) const noexcept -> bool override { return this == &other; }
+
+  std::pmr::monotonic_buffer_resource mRegions;
+  std::pmr::synchronized_pool_resource mStacks;
+};
+
+inline auto printHugePageStats(std::FILE* out = stderr) -> void
+{
+  auto const stats = hugePageStats();
+  std::fprintf(out, "huge pages: hugetlb %llu KiB, thp-advised %llu KiB, normal %llu KiB, live %llu KiB\n",
+               (unsigned long long)(stats.hugeTlbBytes >> 10), (unsigned long long)(stats.transparentBytes >> 10),
+               (unsigned long long)(stats.normalBytes >> 10), (unsigned long long)(stats.liveBytes >> 10));
+}
+
+#ifdef HUGE_PAGES_MAIN_FUNC
+  #include "fiber.hpp"
+  #include "freelist.cpp"
+  #include "spsc_fifo_ring.hpp"
+  #include <cassert>
+
+struct FiberState {
+  FiberHandle self;
+  FiberHandle caller;
+  int count;
+};
+
+auto fiberBody(void* arg) -> void
+{
+  auto* state = static_cast<FiberState*>(arg);
+  state->count += 1;
+  switchFiber(state->self, state->caller);
+}
+
+auto main() -> int
+{
+  {
+    auto region = HugePageRegion(8 << 20);
+    std::memset(region.data(), 1, region.size());
+    std::printf("region: %zu MiB, kind %d, THP-backed now %llu KiB\n", region.size() >> 20, (int)region.kind(),
+                (unsigned long long)(transparentHugeBytes(region.data()) >> 10));
+  }
+
+  auto ring = FIFO<std::uint64_t, 1 << 20, HugePageAllocator<std::uint64_t>>{};
+  // The ring and slab calls stay outside assert so NDEBUG builds still touch the huge-page backed memory.
+  for (std::uint64_t i = 0; i < 1000; i++) {
+    [[maybe_unused]] auto const pushed = ring.push(i);
+    assert(pushed);
+  }
+  auto value = std::uint64_t{0};
+  [[maybe_unused]] auto const popped = ring.pop(value);
+  assert(popped && value == 0);
+
+  auto slab = DenseSlab<std::uint64_t, std::uint32_t, HugePageAllocator<std::uint64_t>>(1 << 18);
+  auto const id = slab.Allocate(std::uint64_t{42});
+  [[maybe_unused]] auto const stored = slab.Get(id);
+  assert(stored == 42);
+
+  auto stacks = HugePageStackResource(64 * 1024);
+  auto state = FiberState{nullptr, createFiberFromThread(), 0};
+  state.self = createFiber(64 * 1024, fiberBody, &state, &stacks);
+  switchFiber(state.caller, state.self);
+  assert(state.count == 1);
+  destroyFiber(state.self, &stacks);
+  destroyFiber(state.caller, free);
+
+  printHugePageStats(stdout);
+}
+#endif
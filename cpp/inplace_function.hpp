@@ -0,0 +1,172 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "manual_lifetime.hpp"
+#include "task_base.hpp"
+
+template <typename Sig, std::size_t N = 48>
+class InplaceFunction;
+
+// Move-only type-erased callable stored in N inline bytes; it never allocates. A callable that does not fit is a
+// compile-time error.
+template <typename R, typename... Args, std::size_t N>
+class InplaceFunction<R(Args...), N> {
+public:
+  static constexpr std::size_t kCapacity = N;
+  static constexpr std::size_t kAlignment = alignof(std::max_align_t);
+
+  InplaceFunction() noexcept = default;
+
+  template <typename F>
+    requires(!std::is_same_v<std::remove_cvref_t<F>, InplaceFunction> && std::is_invocable_r_v<R, F&, Args...>)
+  InplaceFunction(F&& f) noexcept(std::is_nothrow_constructible_v<std::decay_t<F>, F>)
+  {
+    using Fn = std::decay_t<F>;
+    static_assert(sizeof(Fn) <= N, "callable does not fit in InplaceFunction storage, increase N");
+    static_assert(alignof(Fn) <= kAlignment, "callable is over-aligned for InplaceFunction storage");
+    static_assert(std::is_nothrow_move_constructible_v<Fn>, "InplaceFunction requires a nothrow movable callable");
+    ::new (static_cast<void*>(mStorage)) ManualLifetime<Fn>();
+    lifetime<Fn>(mStorage).construct((F &&) f);
+    mOps = &kOps<Fn>;
+  }
+
+  InplaceFunction(InplaceFunction&& other) noexcept : mOps(other.mOps)
+  {
+    if (mOps != nullptr) {
+      mOps->move(mStorage, other.mStorage);
+      other.mOps = nullptr;
+    }
+  }
+  InplaceFunction& operator=(InplaceFunction&& other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      if (other.mOps != nullptr) {
+        other.mOps->move(mStorage, other.mStorage);
+        mOps = std::exchange(other.mOps, nullptr);
+      }
+    }
+    return *this;
+  }
+  InplaceFunction(InplaceFunction const&) = delete;
+  InplaceFunction& operator=(InplaceFunction const&) = delete;
+  ~InplaceFunction() { reset(); }
+
+  auto operator()(Args... args) -> R { return mOps->invoke(mStorage, (Args &&) args...); }
+  explicit operator bool() const noexcept { return mOps != nullptr; }
+
+  auto reset() noexcept -> void
+  {
+    if (mOps != nullptr) {
+      std::exchange(mOps, nullptr)->destroy(mStorage);
+    }
+  }
+
+private:
+  struct Ops {
+    R (*invoke)(void* storage, Args&&... args);
+    void (*move)(void* dst, void* src) noexcept; // leaves src destroyed
+    void (*destroy)(void* storage) noexcept;
+  };
+
+  template <typename Fn>
+  static auto lifetime(void* storage) noexcept -> ManualLifetime<Fn>&
+  {
+    return *std::launder(static_cast<ManualLifetime<Fn>*>(storage));
+  }
+
+  template <typename Fn>
+  static constexpr auto kOps = Ops{
+      [](void* storage, Args&&... args) -> R { return std::invoke(lifetime<Fn>(storage).get(), (Args &&) args...); },
+      [](void* dst, void* src) noexcept {
+        ::new (dst) ManualLifetime<Fn>();
+        lifetime<Fn>(dst).construct(std::move(lifetime<Fn>(src).get()));
+        lifetime<Fn>(src).destruct();
+      },
+      [](void* storage) noexcept { lifetime<Fn>(storage).destruct(); },
+  };
+
+  alignas(kAlignment) std::byte mStorage[N];
+  Ops const* mOps{nullptr};
+};
+
+// Adapts a callable taking nothing to the (worker id) signature tasks are run with; other callables pass through.
+template <typename F>
+  requires(std::is_invocable_v<F&, std::uint32_t> || std::is_invocable_v<F&>)
+auto withWorkerId(F&& f)
+{
+  if constexpr (std::is_invocable_v<F&, std::uint32_t>) {
+    return (F &&) f;
+  } else {
+    return [f = (F &&) f](std::uint32_t) mutable { f(); };
+  }
+}
+
+// A TaskBase carrying its callable inline, so a lambda can be handed to the pools without a heap allocation. The
+// task is owned by the caller and must stay alive until it has run; the callable takes either nothing or the worker
+// id.
+template <std::size_t N = 48>
+class InplaceTask : public TaskBase {
+public:
+  template <typename F>
+    requires(std::is_invocable_v<F&, std::uint32_t> || std::is_invocable_v<F&>)
+  explicit InplaceTask(F&& f) : TaskBase{nullptr, &InplaceTask::run}, mFunc(withWorkerId((F &&) f))
+  {
+  }
+  InplaceTask(InplaceTask const&) = delete;
+  InplaceTask& operator=(InplaceTask const&) = delete;
+
+private:
+  static auto run(TaskBase* task, std::uint32_t tid) noexcept -> void { static_cast<InplaceTask*>(task)->mFunc(tid); }
+
+  InplaceFunction<void(std::uint32_t), N> mFunc;
+};
+
+#ifdef INPLACE_FUNCTION_MAIN_FUNC
+  #include "static_thread_pool.cpp"
+  #include <cassert>
+  #include <cstdio>
+  #include <latch>
+  #include <memory>
+  #include <vector>
+
+auto main() -> int
+{
+  auto counter = std::make_shared<int>(0);
+  {
+    auto f = InplaceFunction<int(int), 32>{[counter](int x) { return *counter += x; }};
+    assert(f(2) == 2);
+    auto g = std::move(f);
+    assert(!f && g(3) == 5);
+    assert(counter.use_count() == 2);
+  }
+  assert(counter.use_count() == 1);
+  // InplaceFunction<void(), 8>{[a = std::array<int, 4>{}] {}}; // does not compile: callable does not fit
+
+  constexpr auto kTasks = 1000;
+  auto done = std::latch{kTasks};
+  auto sum = std::atomic_int{0};
+  auto tasks = std::vector<std::unique_ptr<InplaceTask<>>>{};
+  for (int i = 0; i < kTasks; i++) {
+    tasks.push_back(std::make_unique<InplaceTask<>>([&, i] {
+      sum.fetch_add(i, std::memory_order_relaxed);
+      done.count_down();
+    }));
+  }
+  {
+    auto pool = StaticThreadPool(4);
+    // enqueueing itself allocates nothing, the tasks above are preallocated storage
+    for (auto& task : tasks) {
+      pool.enqueue(task.get());
+    }
+    done.wait();
+  }
+  std::printf("sum %d\n", sum.load());
+  assert(sum.load() == kTasks * (kTasks - 1) / 2);
+}
+#endif
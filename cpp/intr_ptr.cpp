@@ -1,34 +1,536 @@
+#pragma once
+#include "atomic_queue.cpp"
 #include <atomic>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
 #include <memory>
 #include <new>
+#include <span>
+#include <thread>
 #include <utility>
 
-template <typename T>
+// Shared across threads: every copy/release is a locked RMW.
+struct AtomicRefCount {
+  auto addRef() noexcept -> void { mCount.fetch_add(1, std::memory_order_relaxed); }
+  auto release() noexcept -> bool
+  {
+    if (mCount.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+
+  std::atomic_size_t mCount{1};
+};
+
+// Confined to one thread (per shard / per fiber): plain increments, no locked instructions.
+struct LocalRefCount {
+  auto addRef() noexcept -> void { ++mCount; }
+  auto release() noexcept -> bool { return --mCount == 0; }
+
+  std::size_t mCount{1};
+};
+
+struct BiasedOwner;
+
+inline thread_local BiasedOwner* tBiasedOwner = nullptr;
+
+auto releaseBiasedOwner(BiasedOwner* owner) noexcept -> void;
+
+// Biased toward the creating thread: its copies hit the plain mLocal, everybody else uses mShared. When the owner
+// drops its last local reference the counts merge and the object becomes purely shared.
+struct BiasedRefCount {
+  static constexpr std::int64_t kMerged = 1;
+  static constexpr std::int64_t kQueued = 2;
+  static constexpr std::int64_t kOne = 4;
+
+  BiasedRefCount() noexcept;
+
+  auto addRef() noexcept -> void
+  {
+    if (isOwner()) {
+      ++mLocal;
+    } else {
+      mShared.fetch_add(kOne, std::memory_order_relaxed);
+    }
+  }
+
+  auto release() noexcept -> bool
+  {
+    if (isOwner()) {
+      if (--mLocal != 0) {
+        return false;
+      }
+      mMerged = true;
+      auto const old = mShared.fetch_or(kMerged, std::memory_order_acq_rel);
+      releaseBiasedOwner(tBiasedOwner);
+      return (old & kQueued) == 0 && (old >> 2) == 0;
+    }
+    return releaseShared();
+  }
+
+  // Folds the local count into mShared, only the owner (or anyone after the owner exited) may call it.
+  auto merge() noexcept -> bool
+  {
+    auto* const owner = mOwner;
+    auto const local = static_cast<std::int64_t>(std::exchange(mLocal, 0));
+    mMerged = true;
+    auto old = mShared.load(std::memory_order_relaxed);
+    std::int64_t next;
+    do {
+      next = (((old >> 2) + local) << 2) | kMerged;
+    } while (!mShared.compare_exchange_weak(old, next, std::memory_order_acq_rel));
+    // an object the owner already merged can still sit in its queue; only the first merge drops the owner reference
+    if ((old & kMerged) == 0) {
+      releaseBiasedOwner(owner);
+    }
+    return (next >> 2) == 0;
+  }
+
+  auto isOwner() const noexcept -> bool { return mOwner == tBiasedOwner && !mMerged; }
+
+  auto releaseShared() noexcept -> bool;
+
+  BiasedOwner* mOwner;
+  std::size_t mLocal{1};
+  bool mMerged{false};
+  std::atomic<std::int64_t> mShared{0};
+  BiasedRefCount* mNextQueued{nullptr};
+  auto (*mDestroy)(BiasedRefCount* rc) noexcept -> void {nullptr};
+};
+
+// Owner thread of biased refcounts. Non-owners that drive the shared count negative queue the object here so the
+// owner can fold its local count in. The record is referenced by the owner thread until it exits, by every object not
+// merged yet (a late push after thread exit must stay valid), and by a non-owner while it queues an object; the last
+// reference frees it.
+struct BiasedOwner {
+  AtomicQueue<&BiasedRefCount::mNextQueued> mQueued;
+  std::atomic_bool mExited{false};
+  std::atomic_size_t mRefs{1};
+};
+
+inline auto releaseBiasedOwner(BiasedOwner* owner) noexcept -> void
+{
+  if (owner->mRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete owner;
+  }
+}
+
+auto drainBiasedRefCounts(BiasedOwner* owner) noexcept -> void;
+
+// Merges the counts other threads queued for objects owned by this thread. Call it at quiescent points, e.g. once
+// per event loop turn; thread exit drains as well.
+inline auto drainBiasedRefCounts() noexcept -> void
+{
+  if (tBiasedOwner != nullptr) {
+    drainBiasedRefCounts(tBiasedOwner);
+  }
+}
+
+struct BiasedOwnerExit {
+  ~BiasedOwnerExit()
+  {
+    if (tBiasedOwner != nullptr) {
+      auto* owner = std::exchange(tBiasedOwner, nullptr);
+      owner->mExited.store(true, std::memory_order_release);
+      drainBiasedRefCounts(owner);
+      releaseBiasedOwner(owner);
+    }
+  }
+};
+
+inline BiasedRefCount::BiasedRefCount() noexcept
+{
+  if (tBiasedOwner == nullptr) {
+    static thread_local BiasedOwnerExit exit;
+    tBiasedOwner = new BiasedOwner{};
+  }
+  mOwner = tBiasedOwner;
+  mOwner->mRefs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline auto BiasedRefCount::releaseShared() noexcept -> bool
+{
+  auto old = mShared.load(std::memory_order_relaxed);
+  std::int64_t next;
+  do {
+    next = old - kOne;
+    if ((old & (kMerged | kQueued)) == 0 && (next >> 2) < 0) {
+      next |= kQueued;
+    }
+  } while (!mShared.compare_exchange_weak(old, next, std::memory_order_acq_rel));
+
+  if ((next & kQueued) != 0) {
+    if ((old & kQueued) == 0) {
+      // first one below zero hands the object to the owner, which is the only one allowed to read mLocal. Once
+      // pushed, the object may be merged and freed at any time, and with it its reference to the owner record.
+      auto* const owner = mOwner;
+      owner->mRefs.fetch_add(1, std::memory_order_relaxed);
+      owner->mQueued.pushFront(this);
+      if (owner->mExited.load(std::memory_order_acquire)) {
+        drainBiasedRefCounts(owner);
+      }
+      releaseBiasedOwner(owner);
+    }
+    return false;
+  }
+  return (next & kMerged) != 0 && (next >> 2) == 0;
+}
+
+inline auto drainBiasedRefCounts(BiasedOwner* owner) noexcept -> void
+{
+  auto queue = owner->mQueued.popAll();
+  while (!queue.empty()) {
+    auto* rc = queue.popFront();
+    if (rc->merge()) {
+      rc->mDestroy(rc);
+    }
+  }
+}
+
+// Overlays the refcount of a dead control block while it waits to be destroyed.
+struct IntrDeferredNode {
+  IntrDeferredNode* mNext;
+  auto (*mReclaim)(IntrDeferredNode* node) noexcept -> void;
+};
+
+// Destroys blocks deferred by other threads on its own thread, at most mBatchSize per step.
+class IntrReclaimer {
+public:
+  explicit IntrReclaimer(std::size_t batchSize = 256,
+                         std::chrono::microseconds idleSleep = std::chrono::microseconds(500))
+      : mBatchSize(batchSize), mIdleSleep(idleSleep), mThread([this] { run(); })
+  {
+  }
+  ~IntrReclaimer() noexcept
+  {
+    mStopRequested.store(true, std::memory_order_relaxed);
+    mThread.join();
+    reclaimAll(mQueue.popAll());
+  }
+  auto retire(IntrDeferredNode* node) noexcept -> void { mQueue.pushFront(node); }
+
+private:
+  static auto reclaimAll(Queue<&IntrDeferredNode::mNext> queue) noexcept -> void
+  {
+    while (!queue.empty()) {
+      auto* node = queue.popFront();
+      node->mReclaim(node);
+    }
+  }
+  auto run() noexcept -> void
+  {
+    auto pending = Queue<&IntrDeferredNode::mNext>{};
+    while (true) {
+      pending.append(mQueue.popAll());
+      if (pending.empty()) {
+        if (mStopRequested.load(std::memory_order_relaxed)) {
+          return;
+        }
+        std::this_thread::sleep_for(mIdleSleep);
+        continue;
+      }
+      reclaimAll(pending.popFront(mBatchSize));
+    }
+  }
+
+  AtomicQueue<&IntrDeferredNode::mNext> mQueue;
+  std::size_t mBatchSize;
+  std::chrono::microseconds mIdleSleep;
+  std::atomic_bool mStopRequested{false};
+  std::thread mThread;
+};
+
+class IntrDeferScope;
+
+inline thread_local IntrDeferScope* tIntrDeferScope = nullptr;
+
+// While alive, blocks whose last IntrPtr drops on this thread are not destroyed inline. They either go to
+// `reclaimer` or wait in a local list until reclaim() is called at a quiescent point. Scopes nest.
+class IntrDeferScope {
+public:
+  explicit IntrDeferScope(IntrReclaimer* reclaimer = nullptr) noexcept
+      : mReclaimer(reclaimer), mPrev(std::exchange(tIntrDeferScope, this))
+  {
+  }
+  IntrDeferScope(IntrDeferScope const&) = delete;
+  IntrDeferScope& operator=(IntrDeferScope const&) = delete;
+  ~IntrDeferScope() noexcept
+  {
+    // destructors may release more blocks, keep collecting them until the list stays empty
+    while (reclaim(mPendingCount) != 0) {
+    }
+    tIntrDeferScope = mPrev;
+  }
+
+  auto defer(IntrDeferredNode* node) noexcept -> void
+  {
+    if (mReclaimer != nullptr) {
+      mReclaimer->retire(node);
+    } else {
+      mPending.pushBack(node);
+      mPendingCount += 1;
+    }
+  }
+
+  // Destroys at most `budget` deferred blocks in release order; returns how many it destroyed.
+  auto reclaim(std::size_t budget) noexcept -> std::size_t
+  {
+    auto batch = mPending.popFront(budget);
+    auto count = std::size_t{0};
+    while (!batch.empty()) {
+      auto* node = batch.popFront();
+      mPendingCount -= 1;
+      node->mReclaim(node);
+      count += 1;
+    }
+    return count;
+  }
+
+  auto pending() const noexcept -> std::size_t { return mPendingCount; }
+
+private:
+  Queue<&IntrDeferredNode::mNext> mPending;
+  std::size_t mPendingCount{0};
+  IntrReclaimer* mReclaimer;
+  IntrDeferScope* mPrev;
+};
+
+// A refcount policy starts at one reference; release() returns true once the last one is gone.
+template <typename RefCount>
+concept IntrRefCount = std::default_initializable<RefCount> && requires(RefCount& rc) {
+  { rc.addRef() } noexcept;
+  { rc.release() } noexcept -> std::same_as<bool>;
+};
+
+// Strong count plus a weak count; all strong references together hold one weak reference so the storage outlives
+// ~T until the last IntrWeakPtr is gone.
+struct WeakRefCount {
+  auto addRef() noexcept -> void { mStrong.fetch_add(1, std::memory_order_relaxed); }
+  auto release() noexcept -> bool
+  {
+    if (mStrong.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+  // Increments the strong count unless it already dropped to zero.
+  auto tryAddRef() noexcept -> bool
+  {
+    auto count = mStrong.load(std::memory_order_relaxed);
+    while (count != 0) {
+      if (mStrong.compare_exchange_weak(count, count + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  auto addWeak() noexcept -> void { mWeak.fetch_add(1, std::memory_order_relaxed); }
+  auto releaseWeak() noexcept -> bool
+  {
+    if (mWeak.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+  auto expired() const noexcept -> bool { return mStrong.load(std::memory_order_relaxed) == 0; }
+
+  std::atomic_size_t mStrong{1};
+  std::atomic_size_t mWeak{1};
+};
+
+inline auto nextShardIndex() noexcept -> std::uint32_t
+{
+  static auto next = std::atomic_uint32_t{0};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline thread_local std::uint32_t tShardIndex = nextShardIndex();
+
+// For a few hot objects (current config, routing table) copied by every worker: each thread counts on its own padded
+// shard, so copies never bounce one cache line between cores. Sharded releases cannot see zero; the object lives until
+// retireHot() freezes the shards, folds them into mCentral and drops the creator's reference. From then on every
+// operation goes to mCentral and the last release frees the object as usual.
+struct ShardedRefCount {
+  static constexpr std::size_t kShards = 32;
+  // a frozen shard holds this marker; any late fetch_add on it lands far below every real count
+  static constexpr std::int64_t kFrozen = std::numeric_limits<std::int64_t>::min() / 2;
+  // keeps mCentral away from zero while operations that already saw mFrozen race with the folding of the shards
+  static constexpr std::int64_t kCentralBias = std::int64_t{1} << 40;
+
+  auto addRef() noexcept -> void
+  {
+    if (!mFrozen.load(std::memory_order_relaxed) && addShard(1)) [[likely]] {
+      return;
+    }
+    mCentral.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  auto release() noexcept -> bool
+  {
+    if (!mFrozen.load(std::memory_order_relaxed) && addShard(-1)) [[likely]] {
+      return false;
+    }
+    if (mCentral.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
+  }
+
+  // Switches to the central count: every shard is swapped for kFrozen, so each sharded operation either made it into
+  // the sum or sees the marker and redoes itself on mCentral.
+  auto freeze() noexcept -> void
+  {
+    if (mFrozen.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    auto sum = std::int64_t{0};
+    for (auto& shard : mShards) {
+      sum += shard.count.exchange(kFrozen, std::memory_order_acq_rel);
+    }
+    mCentral.fetch_add(sum - kCentralBias, std::memory_order_acq_rel);
+  }
+
+  auto addShard(std::int64_t delta) noexcept -> bool
+  {
+    auto& shard = mShards[tShardIndex % kShards];
+    // a release publishes the releasing thread's writes to the object; freeze()'s acq_rel exchange of the shard
+    // carries them on to whoever destroys it
+    auto const order = delta < 0 ? std::memory_order_release : std::memory_order_relaxed;
+    return shard.count.fetch_add(delta, order) > kFrozen / 2;
+  }
+
+  struct alignas(std::hardware_destructive_interference_size) Shard {
+    std::atomic<std::int64_t> count{0};
+  };
+
+  Shard mShards[kShards];
+  std::atomic<std::int64_t> mCentral{kCentralBias + 1};
+  std::atomic_bool mFrozen{false};
+};
+
+template <typename RefCount>
+concept IntrWeakRefCount = IntrRefCount<RefCount> && requires(RefCount& rc) {
+  { rc.tryAddRef() } noexcept -> std::same_as<bool>;
+  { rc.addWeak() } noexcept;
+  { rc.releaseWeak() } noexcept -> std::same_as<bool>;
+};
+
+template <typename T, IntrRefCount RefCount>
 struct MakeIntr;
 
-template <typename T>
+template <typename T, IntrRefCount RefCount>
+struct AllocateIntr;
+
+template <typename T, IntrRefCount RefCount>
 struct EnableIntrFromThis;
 
-template <typename T>
+template <typename T, IntrWeakRefCount RefCount>
+class IntrWeakPtr;
+
+template <typename T, IntrRefCount RefCount = AtomicRefCount>
 struct ControlBlock {
+  static_assert(std::is_trivially_destructible_v<RefCount>, "the refcount storage is reused once it hits zero");
+
   template <typename... Us>
-  explicit ControlBlock(Us&&... us) noexcept(noexcept(T{std::declval<Us>()...})) : mRefCount(1)
+  explicit ControlBlock(Us&&... us) noexcept(noexcept(T{std::declval<Us>()...})) : mRefCount()
   {
+    if constexpr (std::is_same_v<RefCount, BiasedRefCount>) {
+      mRefCount.mDestroy = &ControlBlock::destroy;
+    }
     ::new ((void*)mValue) T{(Us &&) us...};
   }
 
-  ~ControlBlock() { value().~T(); }
+  ~ControlBlock()
+  {
+    // with weak references ~T already ran when the strong count hit zero
+    if constexpr (!IntrWeakRefCount<RefCount>) {
+      value().~T();
+    }
+  }
   auto value() const noexcept -> T& { return *(T*)mValue; }
 
+  // Called once the count reached zero; runs ~T now or hands the block to the thread's IntrDeferScope.
+  auto dispose() noexcept -> void
+  {
+    if constexpr (IntrWeakRefCount<RefCount>) {
+      // weak pointers still read the count, so there is no dead storage to defer through
+      value().~T();
+      if (mRefCount.releaseWeak()) {
+        mDestroy(this);
+      }
+    } else if (tIntrDeferScope == nullptr) [[likely]] {
+      mDestroy(this);
+    } else {
+      ::new ((void*)&mDeferred) IntrDeferredNode{nullptr, &ControlBlock::reclaim};
+      tIntrDeferScope->defer(&mDeferred);
+    }
+  }
+
+  // Type-erased entry for code holding only the refcount: drainBiasedRefCounts() and aliasing pointers.
+  static auto destroy(RefCount* rc) noexcept -> void
+  {
+    auto* block =
+        reinterpret_cast<ControlBlock*>(reinterpret_cast<std::uint8_t*>(rc) - offsetof(ControlBlock, mRefCount));
+    block->dispose();
+  }
+
+  static auto reclaim(IntrDeferredNode* node) noexcept -> void
+  {
+    auto* block =
+        reinterpret_cast<ControlBlock*>(reinterpret_cast<std::uint8_t*>(node) - offsetof(ControlBlock, mDeferred));
+    block->mDestroy(block);
+  }
+
+  static auto deleteBlock(ControlBlock* block) noexcept -> void { ::delete block; }
+
   alignas(T) std::uint8_t mValue[sizeof(T)];
-  std::atomic_size_t mRefCount;
+  union {
+    RefCount mRefCount;
+    IntrDeferredNode mDeferred;
+  };
+  // Frees the block the way it was allocated, so IntrPtr<T> stays one type whatever the allocator.
+  auto (*mDestroy)(ControlBlock* block) noexcept -> void {&ControlBlock::deleteBlock};
 };
 
-template <typename T>
+// Control block carved from an allocator, the (usually empty) allocator rides along to free it again.
+template <typename T, typename RefCount, typename Alloc>
+struct AllocatedControlBlock : ControlBlock<T, RefCount> {
+  using allocator_type = typename std::allocator_traits<Alloc>::template rebind_alloc<AllocatedControlBlock>;
+  using allocator_traits = std::allocator_traits<allocator_type>;
+
+  template <typename... Us>
+  explicit AllocatedControlBlock(Alloc const& alloc, Us&&... us) noexcept(noexcept(T{std::declval<Us>()...}))
+      : ControlBlock<T, RefCount>((Us &&) us...), mAlloc(alloc)
+  {
+    this->mDestroy = &AllocatedControlBlock::deallocateBlock;
+  }
+
+  static auto deallocateBlock(ControlBlock<T, RefCount>* base) noexcept -> void
+  {
+    auto* block = static_cast<AllocatedControlBlock*>(base);
+    auto alloc = allocator_type(block->mAlloc);
+    std::destroy_at(block);
+    allocator_traits::deallocate(alloc, block, 1);
+  }
+
+  [[no_unique_address]] allocator_type mAlloc;
+};
+
+template <typename T, IntrRefCount RefCount = AtomicRefCount>
 class IntrPtr {
-  friend struct MakeIntr<T>;
-  friend struct EnableIntrFromThis<T>;
+  friend struct MakeIntr<T, RefCount>;
+  friend struct AllocateIntr<T, RefCount>;
+  friend struct EnableIntrFromThis<std::remove_cv_t<T>, RefCount>;
+  template <typename U, IntrWeakRefCount R>
+  friend class IntrWeakPtr;
 
 public:
   IntrPtr() = default;
@@ -43,7 +545,7 @@ public:
   ~IntrPtr() noexcept { release(); }
   auto reset() noexcept -> void { operator=(IntrPtr{}); }
   auto swap(IntrPtr& other) noexcept -> void { std::swap(mData, other.mData); }
-  auto get() const noexcept -> T* { return &mData->value(); }
+  auto get() const noexcept -> T* { return mData != nullptr ? &mData->value() : nullptr; }
   auto operator*() const noexcept -> T& { return mData->value(); }
   explicit operator bool() const noexcept { return mData != nullptr; }
   auto operator!() const noexcept -> bool { return mData == nullptr; }
@@ -52,65 +554,324 @@ public:
 
 private:
   using value_type = std::remove_cv_t<T>;
-  explicit IntrPtr(ControlBlock<value_type>* data) noexcept : mData(data) {}
+  explicit IntrPtr(ControlBlock<value_type, RefCount>* data) noexcept : mData(data) {}
 
   auto addRef() noexcept -> void
   {
     if (mData != nullptr) {
-      mData->mRefCount.fetch_add(1, std::memory_order_relaxed);
+      mData->mRefCount.addRef();
     }
   }
 
   auto release() noexcept -> void
   {
-    if (mData != nullptr && mData->mRefCount.fetch_sub(1, std::memory_order_release) == 1) {
-      std::atomic_thread_fence(std::memory_order_acquire);
-      ::delete mData;
+    if (mData != nullptr && mData->mRefCount.release()) {
+      mData->dispose();
     }
   }
 
 public:
-  ControlBlock<value_type>* mData{nullptr};
+  ControlBlock<value_type, RefCount>* mData{nullptr};
+};
+
+template <typename T>
+using LocalIntrPtr = IntrPtr<T, LocalRefCount>;
+
+template <typename T>
+using BiasedIntrPtr = IntrPtr<T, BiasedRefCount>;
+
+template <typename T>
+using HotIntrPtr = IntrPtr<T, ShardedRefCount>;
+
+// Ends the hot phase of a sharded object (e.g. after publishing its replacement) and drops `ptr`; remaining copies
+// then release through the central count.
+template <typename T>
+auto retireHot(HotIntrPtr<T> ptr) noexcept -> void
+{
+  if (ptr) {
+    ptr.mData->mRefCount.freeze();
+  }
+}
+
+// Non-owning reference into the same ControlBlock: does not keep T alive, only its storage.
+template <typename T, IntrWeakRefCount RefCount = WeakRefCount>
+class IntrWeakPtr {
+public:
+  IntrWeakPtr() = default;
+  IntrWeakPtr(IntrPtr<T, RefCount> const& ptr) noexcept : mData(ptr.mData) { addWeak(); }
+  IntrWeakPtr(IntrWeakPtr&& other) noexcept : mData(std::exchange(other.mData, nullptr)) {}
+  IntrWeakPtr(IntrWeakPtr const& other) noexcept : mData(other.mData) { addWeak(); }
+  IntrWeakPtr& operator=(IntrWeakPtr&& other) noexcept
+  {
+    [[maybe_unused]] IntrWeakPtr old{std::exchange(mData, std::exchange(other.mData, nullptr))};
+    return *this;
+  }
+  IntrWeakPtr& operator=(IntrWeakPtr const& other) noexcept { return operator=(IntrWeakPtr{other}); }
+  ~IntrWeakPtr() noexcept { releaseWeak(); }
+  auto reset() noexcept -> void { operator=(IntrWeakPtr{}); }
+  auto swap(IntrWeakPtr& other) noexcept -> void { std::swap(mData, other.mData); }
+  auto expired() const noexcept -> bool { return mData == nullptr || mData->mRefCount.expired(); }
+
+  auto lock() const noexcept -> IntrPtr<T, RefCount>
+  {
+    if (mData != nullptr && mData->mRefCount.tryAddRef()) {
+      return IntrPtr<T, RefCount>{mData};
+    }
+    return IntrPtr<T, RefCount>{};
+  }
+
+private:
+  using value_type = std::remove_cv_t<T>;
+  explicit IntrWeakPtr(ControlBlock<value_type, RefCount>* data) noexcept : mData(data) {}
+
+  auto addWeak() noexcept -> void
+  {
+    if (mData != nullptr) {
+      mData->mRefCount.addWeak();
+    }
+  }
+
+  auto releaseWeak() noexcept -> void
+  {
+    if (mData != nullptr && mData->mRefCount.releaseWeak()) {
+      mData->mDestroy(mData);
+    }
+  }
+
+  ControlBlock<value_type, RefCount>* mData{nullptr};
 };
 
-template <class T>
+template <class T, IntrRefCount RefCount = AtomicRefCount>
 struct EnableIntrFromThis {
-  auto intrFromThis() noexcept -> IntrPtr<T>
+  using Block = ControlBlock<T, RefCount>;
+
+  auto intrFromThis() noexcept -> IntrPtr<T, RefCount>
   {
-    static_assert(0 == offsetof(ControlBlock<T>, mValue));
+    static_assert(0 == offsetof(Block, mValue));
     T* this_ = static_cast<T*>(this);
-    IntrPtr<T> ptr{(ControlBlock<T>*)this_};
+    IntrPtr<T, RefCount> ptr{(Block*)this_};
     ptr.addRef();
     return ptr;
   }
 
-  auto intrFromThis() const noexcept -> IntrPtr<T const>
+  auto intrFromThis() const noexcept -> IntrPtr<T const, RefCount>
   {
-    static_assert(0 == offsetof(ControlBlock<T>, mValue));
+    static_assert(0 == offsetof(Block, mValue));
     T const* this_ = static_cast<T const*>(this);
-    IntrPtr<T const> ptr{(ControlBlock<T>*)this_};
+    IntrPtr<T const, RefCount> ptr{(Block*)this_};
     ptr.addRef();
     return ptr;
   }
 };
 
-template <class T>
+template <class T, IntrRefCount RefCount>
 struct MakeIntr {
   template <class... Us>
     requires std::is_constructible_v<T, Us...>
-  IntrPtr<T> operator()(Us&&... us) const
+  IntrPtr<T, RefCount> operator()(Us&&... us) const
   {
     using _UncvTy = std::remove_cv_t<T>;
-    return IntrPtr<T>{::new ControlBlock<_UncvTy>{(Us &&) us...}};
+    return IntrPtr<T, RefCount>{::new ControlBlock<_UncvTy, RefCount>{(Us &&) us...}};
   }
 };
 
-template <typename T>
-inline constexpr MakeIntr<T> makeIntr{};
+template <typename T, IntrRefCount RefCount = AtomicRefCount>
+inline constexpr MakeIntr<T, RefCount> makeIntr{};
+
+// makeIntr through an allocator (per-thread pool, arena, std::pmr resource) instead of global new.
+template <class T, IntrRefCount RefCount>
+struct AllocateIntr {
+  template <class Alloc, class... Us>
+    requires std::is_constructible_v<T, Us...>
+  IntrPtr<T, RefCount> operator()(Alloc const& alloc, Us&&... us) const
+  {
+    using Block = AllocatedControlBlock<std::remove_cv_t<T>, RefCount, Alloc>;
+    auto blockAlloc = typename Block::allocator_type(alloc);
+    auto* block = Block::allocator_traits::allocate(blockAlloc, 1);
+    try {
+      ::new ((void*)block) Block{alloc, (Us &&) us...};
+    } catch (...) {
+      Block::allocator_traits::deallocate(blockAlloc, block, 1);
+      throw;
+    }
+    return IntrPtr<T, RefCount>{block};
+  }
+};
+
+template <typename T, IntrRefCount RefCount = AtomicRefCount>
+inline constexpr AllocateIntr<T, RefCount> allocateIntr{};
+
+// Strong reference to whichever block owns an aliased pointer, without knowing its type.
+template <IntrRefCount RefCount>
+class IntrOwnerRef {
+public:
+  using DisposeFn = auto (*)(RefCount* rc) noexcept -> void;
+
+  IntrOwnerRef() = default;
+  // Adopts one reference already counted in `rc`.
+  IntrOwnerRef(RefCount* rc, DisposeFn dispose) noexcept : mRefCount(rc), mDispose(dispose) {}
+  IntrOwnerRef(IntrOwnerRef&& other) noexcept
+      : mRefCount(std::exchange(other.mRefCount, nullptr)), mDispose(other.mDispose)
+  {
+  }
+  IntrOwnerRef(IntrOwnerRef const& other) noexcept : mRefCount(other.mRefCount), mDispose(other.mDispose)
+  {
+    if (mRefCount != nullptr) {
+      mRefCount->addRef();
+    }
+  }
+  IntrOwnerRef& operator=(IntrOwnerRef other) noexcept
+  {
+    std::swap(mRefCount, other.mRefCount);
+    std::swap(mDispose, other.mDispose);
+    return *this;
+  }
+  ~IntrOwnerRef() noexcept
+  {
+    if (mRefCount != nullptr && mRefCount->release()) {
+      mDispose(mRefCount);
+    }
+  }
+
+  template <typename T>
+  static auto from(IntrPtr<T, RefCount> owner) noexcept -> IntrOwnerRef
+  {
+    using Block = ControlBlock<std::remove_cv_t<T>, RefCount>;
+    if (owner.mData == nullptr) {
+      return IntrOwnerRef{};
+    }
+    return IntrOwnerRef{&std::exchange(owner.mData, nullptr)->mRefCount, &Block::destroy};
+  }
+
+  auto operator==(IntrOwnerRef const& other) const noexcept -> bool { return mRefCount == other.mRefCount; }
+
+private:
+  RefCount* mRefCount{nullptr};
+  DisposeFn mDispose{nullptr};
+};
+
+// Points at a sub-object (a member, an array element) while keeping the whole parent block alive.
+template <typename T, IntrRefCount RefCount = AtomicRefCount>
+class IntrAliasPtr {
+public:
+  IntrAliasPtr() = default;
+  IntrAliasPtr(IntrOwnerRef<RefCount> owner, T* ptr) noexcept : mPtr(ptr), mOwner(std::move(owner)) {}
+  template <typename U>
+  IntrAliasPtr(IntrPtr<U, RefCount> owner, T* ptr) noexcept
+      : mPtr(ptr), mOwner(IntrOwnerRef<RefCount>::from(std::move(owner)))
+  {
+  }
+  template <typename U>
+  IntrAliasPtr(IntrAliasPtr<U, RefCount> const& owner, T* ptr) noexcept : mPtr(ptr), mOwner(owner.owner())
+  {
+  }
+
+  auto reset() noexcept -> void { *this = IntrAliasPtr{}; }
+  auto get() const noexcept -> T* { return mPtr; }
+  auto operator*() const noexcept -> T& { return *mPtr; }
+  auto operator->() const noexcept -> T* { return mPtr; }
+  explicit operator bool() const noexcept { return mPtr != nullptr; }
+  auto operator==(std::nullptr_t) const noexcept -> bool { return mPtr == nullptr; }
+  auto owner() const noexcept -> IntrOwnerRef<RefCount> const& { return mOwner; }
+
+private:
+  T* mPtr{nullptr};
+  IntrOwnerRef<RefCount> mOwner;
+};
+
+// Header and elements in one allocation.
+template <typename T, IntrRefCount RefCount>
+struct IntrArrayBlock {
+  static constexpr std::size_t kAlign = alignof(T) > alignof(RefCount) ? alignof(T) : alignof(RefCount);
+
+  static constexpr auto elementsOffset() noexcept -> std::size_t
+  {
+    return (sizeof(IntrArrayBlock) + alignof(T) - 1) / alignof(T) * alignof(T);
+  }
+
+  template <typename... Us>
+  static auto create(std::size_t n, Us const&... us) -> IntrArrayBlock*
+  {
+    auto* raw = ::operator new(elementsOffset() + n * sizeof(T), std::align_val_t{kAlign});
+    auto* block = ::new (raw) IntrArrayBlock{};
+    if constexpr (std::is_same_v<RefCount, BiasedRefCount>) {
+      block->mRefCount.mDestroy = &IntrArrayBlock::destroy;
+    }
+    block->mSize = n;
+    auto* first = block->elements();
+    std::size_t i = 0;
+    try {
+      for (; i < n; i++) {
+        ::new ((void*)(first + i)) T{us...};
+      }
+    } catch (...) {
+      std::destroy_n(first, i);
+      ::operator delete(raw, std::align_val_t{kAlign});
+      throw;
+    }
+    return block;
+  }
+
+  // Array blocks are destroyed inline, IntrDeferScope does not apply to them.
+  static auto destroy(RefCount* rc) noexcept -> void
+  {
+    auto* block = reinterpret_cast<IntrArrayBlock*>(rc);
+    std::destroy_n(block->elements(), block->mSize);
+    block->~IntrArrayBlock();
+    ::operator delete((void*)block, std::align_val_t{kAlign});
+  }
+
+  auto elements() noexcept -> T* { return reinterpret_cast<T*>(reinterpret_cast<std::uint8_t*>(this) + elementsOffset()); }
+
+  RefCount mRefCount;
+  std::size_t mSize{0};
+};
+
+// Refcounted view over a range of an intrusive array; slices share the parent's count, nothing is copied.
+template <typename T, IntrRefCount RefCount = AtomicRefCount>
+class IntrSpan {
+public:
+  IntrSpan() = default;
+  IntrSpan(IntrOwnerRef<RefCount> owner, std::span<T> span) noexcept : mSpan(span), mOwner(std::move(owner)) {}
+
+  auto data() const noexcept -> T* { return mSpan.data(); }
+  auto size() const noexcept -> std::size_t { return mSpan.size(); }
+  auto empty() const noexcept -> bool { return mSpan.empty(); }
+  auto begin() const noexcept { return mSpan.begin(); }
+  auto end() const noexcept { return mSpan.end(); }
+  auto operator[](std::size_t idx) const noexcept -> T& { return mSpan[idx]; }
+  auto span() const noexcept -> std::span<T> { return mSpan; }
+  explicit operator bool() const noexcept { return mSpan.data() != nullptr; }
+  auto reset() noexcept -> void { *this = IntrSpan{}; }
+
+  auto subspan(std::size_t offset, std::size_t count = std::dynamic_extent) const noexcept -> IntrSpan
+  {
+    return IntrSpan{mOwner, mSpan.subspan(offset, count)};
+  }
+  auto alias(std::size_t idx) const noexcept -> IntrAliasPtr<T, RefCount> { return {mOwner, &mSpan[idx]}; }
+  auto owner() const noexcept -> IntrOwnerRef<RefCount> const& { return mOwner; }
+
+private:
+  std::span<T> mSpan;
+  IntrOwnerRef<RefCount> mOwner;
+};
+
+// n elements constructed from `us` (value-initialized without arguments), header in the same allocation.
+template <typename T, IntrRefCount RefCount = AtomicRefCount, typename... Us>
+  requires std::is_constructible_v<T, Us const&...>
+auto makeIntrArray(std::size_t n, Us const&... us) -> IntrSpan<T, RefCount>
+{
+  using Block = IntrArrayBlock<std::remove_cv_t<T>, RefCount>;
+  auto* block = Block::create(n, us...);
+  return IntrSpan<T, RefCount>{IntrOwnerRef<RefCount>{&block->mRefCount, &Block::destroy}, {block->elements(), n}};
+}
 
-#define INTR_PTR_MAIN_FUNC
 #ifdef INTR_PTR_MAIN_FUNC
+  #include <array>
   #include <cassert>
+  #include <memory_resource>
+  #include <thread>
+  #include <vector>
 struct MyObject : EnableIntrFromThis<MyObject> {
   int value;
 
@@ -167,6 +928,155 @@ int main()
   assert(ptr6 != nullptr);
   assert(ptr3 == nullptr);
 
+  // Test thread-confined refcount policy
+  struct LocalObject : EnableIntrFromThis<LocalObject, LocalRefCount> {
+    int value;
+    LocalObject(int val) : value(val) {}
+  };
+  auto local1 = makeIntr<LocalObject, LocalRefCount>(7);
+  auto local2 = (*local1).intrFromThis();
+  LocalIntrPtr<LocalObject> local3 = local2;
+  assert(local1.mData->mRefCount.mCount == 3);
+  local2.reset();
+  local3.reset();
+  assert(local1.mData->mRefCount.mCount == 1);
+  assert((*local1).value == 7);
+
+  // Test biased refcount: handed off once to another thread which drops the last reference
+  static int biasedAlive = 0;
+  struct BiasedObject {
+    BiasedObject() { biasedAlive++; }
+    ~BiasedObject() { biasedAlive--; }
+  };
+  auto biased1 = makeIntr<BiasedObject, BiasedRefCount>();
+  auto biased2 = biased1;
+  assert(biased1.mData->mRefCount.mLocal == 2);
+  std::thread([p = std::move(biased2)]() mutable { p.reset(); }).join();
+  biased1.reset();
+  assert(biasedAlive == 1);
+  drainBiasedRefCounts();
+  assert(biasedAlive == 0);
+
+  // Owner lets go first, the other thread finishes the object on the shared count
+  auto biased3 = makeIntr<BiasedObject, BiasedRefCount>();
+  auto biased4 = BiasedIntrPtr<BiasedObject>{};
+  std::thread([&] { biased4 = biased3; }).join();
+  biased3.reset();
+  assert(biasedAlive == 1);
+  std::thread([&] { biased4.reset(); }).join();
+  assert(biasedAlive == 0);
+
+  // Test allocator-aware creation
+  auto buffer = std::array<std::byte, 1024>{};
+  auto arena = std::pmr::monotonic_buffer_resource(buffer.data(), buffer.size(), std::pmr::null_memory_resource());
+  auto pooled1 = allocateIntr<MyObject>(std::pmr::polymorphic_allocator<MyObject>(&arena), 5);
+  auto pooled2 = pooled1;
+  assert((std::byte*)pooled1.get() >= buffer.data() && (std::byte*)pooled1.get() < buffer.data() + buffer.size());
+  assert((*pooled2).value == 5);
+  pooled1.reset();
+  pooled2.reset();
+  auto pooled3 = allocateIntr<BiasedObject, LocalRefCount>(std::allocator<BiasedObject>{});
+  assert(biasedAlive == 1);
+  pooled3.reset();
+  assert(biasedAlive == 0);
+
+  // Test deferred release: a chain of objects is torn down a few links per step
+  struct Link {
+    IntrPtr<Link> next;
+    BiasedObject tracker{};
+  };
+  {
+    auto scope = IntrDeferScope{};
+    auto head = makeIntr<Link>();
+    for (int i = 0; i < 9; i++) {
+      head = makeIntr<Link>(std::move(head));
+    }
+    assert(biasedAlive == 10);
+    head.reset();
+    assert(biasedAlive == 10 && scope.pending() == 1);
+    assert(scope.reclaim(4) == 1 && scope.pending() == 1);
+    assert(biasedAlive == 9);
+    while (scope.reclaim(4) != 0) {
+    }
+    assert(biasedAlive == 0);
+    // reclaiming exactly what is pending empties the list, deferring afterwards starts a fresh one
+    auto a = makeIntr<BiasedObject>();
+    auto b = makeIntr<BiasedObject>();
+    a.reset();
+    assert(scope.reclaim(scope.pending()) == 1 && scope.pending() == 0);
+    b.reset();
+    assert(scope.pending() == 1 && scope.reclaim(1) == 1 && biasedAlive == 0);
+  }
+  {
+    auto reclaimer = IntrReclaimer{};
+    auto scope = IntrDeferScope{&reclaimer};
+    for (int i = 0; i < 100; i++) {
+      auto obj = makeIntr<BiasedObject>();
+    }
+  }
+  assert(biasedAlive == 0);
+
+  // Test weak references: ~T runs with the last strong ref, lock() fails afterwards
+  auto strong1 = makeIntr<BiasedObject, WeakRefCount>();
+  auto weak1 = IntrWeakPtr<BiasedObject>{strong1};
+  auto weak2 = weak1;
+  assert(!weak1.expired());
+  auto strong2 = weak2.lock();
+  assert(strong2 == strong1);
+  strong1.reset();
+  assert(biasedAlive == 1 && !weak1.expired());
+  strong2.reset();
+  assert(biasedAlive == 0 && weak1.expired());
+  assert(!weak2.lock());
+  weak1.reset();
+  weak2.reset();
+
+  // Test intrusive arrays and aliasing pointers
+  auto packet = makeIntrArray<std::uint8_t>(1500, std::uint8_t{0xab});
+  assert(packet.size() == 1500 && packet[1499] == 0xab);
+  auto payload = packet.subspan(40, 100);
+  auto firstByte = payload.alias(0);
+  packet.reset();
+  payload = payload.subspan(10);
+  assert(payload.size() == 90 && *firstByte == 0xab);
+  payload.reset();
+  firstByte.reset();
+
+  struct Big {
+    BiasedObject tracker;
+    int member = 11;
+  };
+  auto big = makeIntr<Big>();
+  auto member = IntrAliasPtr<int>{big, &(*big).member};
+  big.reset();
+  assert(biasedAlive == 1 && *member == 11);
+  auto member2 = member;
+  member.reset();
+  member2.reset();
+  assert(biasedAlive == 0);
+  assert(big.get() == nullptr);
+
+  // Test sharded refcount: copies from many threads, destroyed only after the hot phase ends
+  auto hot = makeIntr<BiasedObject, ShardedRefCount>();
+  auto hotCopies = std::vector<HotIntrPtr<BiasedObject>>{};
+  auto hotThreads = std::vector<std::thread>{};
+  for (int i = 0; i < 4; i++) {
+    hotThreads.emplace_back([&hot] {
+      for (int j = 0; j < 10'000; j++) {
+        auto copy = hot;
+      }
+    });
+  }
+  for (auto& t : hotThreads) {
+    t.join();
+  }
+  hotCopies.push_back(hot);
+  retireHot(std::move(hot));
+  assert(biasedAlive == 1);
+  hotCopies.push_back(hotCopies.back());
+  hotCopies.clear();
+  assert(biasedAlive == 0);
+
   return 0;
 }
 
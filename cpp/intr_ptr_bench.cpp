@@ -0,0 +1,200 @@
+#include "intr_ptr.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <latch>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Microbenchmarks of IntrPtr (per refcount policy) against std::shared_ptr. Prints CSV rows to stdout:
+//   benchmark,pointer,threads,ops,ns_per_op
+
+template <typename T>
+inline auto doNotOptimize(T const& value) -> void
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct SharedKind {
+  static constexpr std::string_view kName = "shared_ptr";
+  template <typename T>
+  using Ptr = std::shared_ptr<T>;
+
+  template <typename T, typename... Us>
+  static auto make(Us&&... us) -> Ptr<T>
+  {
+    return std::make_shared<T>((Us &&) us...);
+  }
+  template <typename T>
+  static auto deref(Ptr<T> const& p) -> T&
+  {
+    return *p;
+  }
+};
+
+template <IntrRefCount RefCount>
+struct IntrKind {
+  static constexpr std::string_view kName = std::is_same_v<RefCount, AtomicRefCount>   ? "intr_atomic"
+                                            : std::is_same_v<RefCount, LocalRefCount>  ? "intr_local"
+                                            : std::is_same_v<RefCount, BiasedRefCount> ? "intr_biased"
+                                            : std::is_same_v<RefCount, ShardedRefCount> ? "intr_sharded"
+                                                                                        : "intr_other";
+  template <typename T>
+  using Ptr = IntrPtr<T, RefCount>;
+
+  template <typename T, typename... Us>
+  static auto make(Us&&... us) -> Ptr<T>
+  {
+    return makeIntr<T, RefCount>((Us &&) us...);
+  }
+  template <typename T>
+  static auto deref(Ptr<T> const& p) -> T&
+  {
+    return *p;
+  }
+};
+
+struct Payload {
+  std::uint64_t value;
+};
+
+constexpr auto kCopyOps = 20'000'000;
+constexpr auto kCreateOps = 5'000'000;
+constexpr auto kListLength = 1'000'000;
+constexpr auto kChaseRounds = 20;
+
+auto report(std::string_view bench, std::string_view pointer, int threads, std::uint64_t ops,
+            std::chrono::nanoseconds elapsed) -> void
+{
+  std::printf("%.*s,%.*s,%d,%llu,%.3f\n", (int)bench.size(), bench.data(), (int)pointer.size(), pointer.data(),
+              threads, (unsigned long long)ops, (double)elapsed.count() / (double)ops);
+}
+
+template <typename F>
+auto timed(F&& f) -> std::chrono::nanoseconds
+{
+  auto const start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::steady_clock::now() - start;
+}
+
+// copy + destroy of one pointer on one thread
+template <typename Kind>
+auto benchCopy() -> void
+{
+  auto p = Kind::template make<Payload>(Payload{1});
+  auto elapsed = timed([&] {
+    for (int i = 0; i < kCopyOps; i++) {
+      auto copy = p;
+      doNotOptimize(copy);
+    }
+  });
+  report("copy_destroy", Kind::kName, 1, kCopyOps, elapsed);
+}
+
+// every thread copies the same object, all counts live on one cache line
+template <typename Kind>
+auto benchContended(int threads) -> void
+{
+  auto p = Kind::template make<Payload>(Payload{1});
+  auto start = std::latch{threads + 1};
+  auto workers = std::vector<std::thread>{};
+  auto const opsPerThread = kCopyOps / threads;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&] {
+      start.arrive_and_wait();
+      for (int i = 0; i < opsPerThread; i++) {
+        auto copy = p;
+        doNotOptimize(copy);
+      }
+    });
+  }
+  auto elapsed = timed([&] {
+    start.arrive_and_wait();
+    for (auto& w : workers) {
+      w.join();
+    }
+  });
+  report("copy_contended", Kind::kName, threads, (std::uint64_t)opsPerThread * threads, elapsed);
+  if constexpr (std::is_same_v<Kind, IntrKind<ShardedRefCount>>) {
+    retireHot(std::move(p));
+  }
+}
+
+template <typename Kind>
+auto benchCreate() -> void
+{
+  auto elapsed = timed([&] {
+    for (int i = 0; i < kCreateOps; i++) {
+      auto p = Kind::template make<Payload>(Payload{(std::uint64_t)i});
+      doNotOptimize(p);
+    }
+  });
+  report("create_destroy", Kind::kName, 1, kCreateOps, elapsed);
+}
+
+// walks a linked list the way refcounted traversals do: every hop copies the next pointer
+template <typename Kind>
+auto benchChase() -> void
+{
+  struct Node {
+    typename Kind::template Ptr<Node> next;
+    std::uint64_t value;
+  };
+  auto head = typename Kind::template Ptr<Node>{};
+  for (int i = 0; i < kListLength; i++) {
+    head = Kind::template make<Node>(std::move(head), (std::uint64_t)i);
+  }
+  auto sum = std::uint64_t{0};
+  auto elapsed = timed([&] {
+    for (int r = 0; r < kChaseRounds; r++) {
+      for (auto p = head; p; p = Kind::deref(p).next) {
+        sum += Kind::deref(p).value;
+      }
+    }
+  });
+  doNotOptimize(sum);
+  report("pointer_chase", Kind::kName, 1, (std::uint64_t)kListLength * kChaseRounds, elapsed);
+  // unlink iteratively, a recursive teardown of a million nodes would overflow the stack
+  while (head) {
+    head = std::move(Kind::deref(head).next);
+  }
+}
+
+template <typename Kind>
+auto benchSingleThreaded() -> void
+{
+  benchCopy<Kind>();
+  benchCreate<Kind>();
+  benchChase<Kind>();
+}
+
+#ifdef INTR_PTR_BENCH_MAIN_FUNC
+auto main() -> int
+{
+  // libstdc++'s shared_ptr skips atomics until the process starts its first thread, which would flatter it
+  std::thread([] {}).join();
+  std::puts("benchmark,pointer,threads,ops,ns_per_op");
+  benchSingleThreaded<SharedKind>();
+  benchSingleThreaded<IntrKind<AtomicRefCount>>();
+  benchSingleThreaded<IntrKind<LocalRefCount>>();
+  benchSingleThreaded<IntrKind<BiasedRefCount>>();
+
+  auto const maxThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+  // powers of two, and always the whole machine last (e.g. 1, 2, 4, 8, 16, 24)
+  for (int threads = 1;; threads = std::min(threads * 2, maxThreads)) {
+    benchContended<SharedKind>(threads);
+    benchContended<IntrKind<AtomicRefCount>>(threads);
+    benchContended<IntrKind<BiasedRefCount>>(threads);
+    benchContended<IntrKind<ShardedRefCount>>(threads);
+    if (threads == maxThreads) {
+      break;
+    }
+  }
+  return 0;
+}
+#endif
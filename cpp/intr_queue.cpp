@@ -1,3 +1,4 @@
+#pragma once
 #include <algorithm>
 #include <cassert>
 #include <utility>
@@ -72,22 +73,21 @@ public:
     mTail = item;
   }
 
+  // Splits off the first min(n, size) items.
   auto popFront(std::size_t n) noexcept -> Queue
   {
     auto q = Queue();
-    q.mHead = mHead;
-    q.mTail = mHead;
-    for (std::size_t i = 1; i < n; i++) {
-      if (q.mTail == nullptr) {
-        break;
-      }
-      q.mTail = q.mTail->*next;
+    if (n == 0 || mHead == nullptr) {
+      return q;
     }
-    if (q.mTail != nullptr) {
-      mHead = q.mTail->*next;
-      q.mTail->*next = nullptr;
-    } else {
-      mHead = nullptr;
+    auto* last = mHead;
+    for (std::size_t i = 1; i < n && last->*next != nullptr; i++) {
+      last = last->*next;
+    }
+    q.mHead = std::exchange(mHead, last->*next);
+    q.mTail = last;
+    last->*next = nullptr;
+    if (mHead == nullptr) {
       mTail = nullptr;
     }
     return q;
@@ -0,0 +1,290 @@
+#pragma once
+#include "panic.cpp"
+#include "spsc_fifo_ring.hpp"
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Deferred logging on top of PanicFormat. The calling thread only copies the static format string, the source
+// location and the raw argument bytes into its own SPSC ring; formatting and I/O happen on the logger thread.
+
+enum class LogLevel : std::uint8_t { Debug, Info, Warn, Error };
+
+inline auto logLevelName(LogLevel level) noexcept -> std::string_view
+{
+  switch (level) {
+  case LogLevel::Debug:
+    return "DEBUG";
+  case LogLevel::Info:
+    return "INFO";
+  case LogLevel::Warn:
+    return "WARN";
+  case LogLevel::Error:
+    return "ERROR";
+  }
+  return "?";
+}
+
+constexpr std::size_t kLogArgBytes = 64;
+constexpr std::size_t kLogRingCapacity = 1024;
+
+struct LogRecord {
+  using FormatFn = auto (*)(LogRecord const&, std::string& out) -> void;
+
+  FormatFn format;
+  std::string_view fmt;
+  std::source_location loc;
+  std::int64_t timeNs;
+  LogLevel level;
+  std::byte args[kLogArgBytes];
+};
+
+// Arguments are copied bytewise and formatted later, so they must be trivially copyable. Pointers and string views
+// are copied as-is and have to point at storage that outlives the flush, string literals for example.
+template <typename T>
+concept LogArg = std::is_trivially_copyable_v<std::decay_t<T>>;
+
+template <typename... Ts>
+constexpr std::size_t kLogArgsSize = (std::size_t{0} + ... + sizeof(Ts));
+
+template <typename... Ts>
+auto formatLogRecord(LogRecord const& record, std::string& out) -> void
+{
+  auto offset = std::size_t{0};
+  auto load = [&]<typename T>(std::type_identity<T>) {
+    auto bytes = std::array<std::byte, sizeof(T)>{};
+    std::memcpy(bytes.data(), record.args + offset, sizeof(T));
+    offset += sizeof(T);
+    return std::bit_cast<T>(bytes);
+  };
+  // braced initialization evaluates the loads left to right
+  auto values = std::tuple<Ts...>{load(std::type_identity<Ts>{})...};
+  std::apply([&](auto&... vs) { std::vformat_to(std::back_inserter(out), record.fmt, std::make_format_args(vs...)); },
+             values);
+}
+
+struct LogThreadRing {
+  FIFO<LogRecord, kLogRingCapacity> ring;
+  std::atomic<std::uint64_t> dropped{0};
+  std::atomic_bool exited{false};
+};
+
+class Logger;
+
+struct LogThreadHandle {
+  // Once the ring is marked, the logger may free it at any time. Both pointers are cleared and `exited` makes records
+  // logged later on this thread (from another thread_local's destructor) get dropped instead of reaching a new ring
+  // that no one would ever retire.
+  ~LogThreadHandle()
+  {
+    if (ring != nullptr) {
+      std::exchange(ring, nullptr)->exited.store(true, std::memory_order_release);
+    }
+    logger = nullptr;
+    exited = true;
+  }
+
+  Logger* logger{nullptr};
+  LogThreadRing* ring{nullptr};
+  bool exited{false};
+};
+
+inline thread_local LogThreadHandle tLogThread;
+
+class Logger {
+public:
+  explicit Logger(int fd = STDERR_FILENO, std::chrono::microseconds idleSleep = std::chrono::microseconds(1000))
+      : mFd(fd), mIdleSleep(idleSleep), mThread([this] { run(); })
+  {
+  }
+  Logger(Logger const&) = delete;
+  Logger& operator=(Logger const&) = delete;
+  ~Logger() noexcept
+  {
+    mStopRequested.store(true, std::memory_order_relaxed);
+    mThread.join();
+    flush();
+  }
+
+  // A failed MY_CHECK writes out this logger's queued records before it panics.
+  static auto global() -> Logger&
+  {
+    static auto logger = Logger{};
+    [[maybe_unused]] static auto const hooked = [] {
+      gPanicCheckHook.store([]() noexcept { logger.flush(); }, std::memory_order_release);
+      return true;
+    }();
+    return logger;
+  }
+
+  auto setLevel(LogLevel level) noexcept -> void { mLevel.store(level, std::memory_order_relaxed); }
+  auto enabled(LogLevel level) const noexcept -> bool { return level >= mLevel.load(std::memory_order_relaxed); }
+
+  // Never blocks: when the thread's ring is full the record is dropped and counted.
+  template <typename... Ts>
+  auto push(LogLevel level, std::string_view fmt, std::source_location loc, Ts const&... values) noexcept -> void
+  {
+    static_assert(kLogArgsSize<Ts...> <= kLogArgBytes, "log arguments do not fit in LogRecord::args");
+    auto record = LogRecord{&formatLogRecord<Ts...>, fmt, loc, nowNs(), level, {}};
+    auto offset = std::size_t{0};
+    ((std::memcpy(record.args + offset, std::addressof(values), sizeof(Ts)), offset += sizeof(Ts)), ...);
+    auto* ring = threadRing();
+    if (ring == nullptr) [[unlikely]] {
+      return;
+    }
+    if (!ring->ring.push(record)) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Formats and writes everything queued so far, from the calling thread.
+  auto flush() noexcept -> void
+  {
+    while (drain() != 0) {
+    }
+  }
+
+private:
+  static auto nowNs() noexcept -> std::int64_t
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // nullptr once this thread's LogThreadHandle is gone
+  auto threadRing() noexcept -> LogThreadRing*
+  {
+    if (tLogThread.logger != this) [[unlikely]] {
+      if (tLogThread.exited) {
+        return nullptr;
+      }
+      if (tLogThread.ring != nullptr) {
+        tLogThread.ring->exited.store(true, std::memory_order_release);
+      }
+      auto ring = std::make_unique<LogThreadRing>();
+      tLogThread.logger = this;
+      tLogThread.ring = ring.get();
+      auto lock = std::lock_guard{mMutex};
+      mRings.push_back(std::move(ring));
+    }
+    return tLogThread.ring;
+  }
+
+  auto appendRecord(LogRecord const& record) -> void
+  {
+    auto const time = std::chrono::sys_time<std::chrono::nanoseconds>{std::chrono::nanoseconds{record.timeNs}};
+    std::format_to(std::back_inserter(mBuffer), "{:%F %T} {} {}:{}] ", time, logLevelName(record.level),
+                   record.loc.file_name(), record.loc.line());
+    record.format(record, mBuffer);
+    mBuffer.push_back('\n');
+  }
+
+  // One pass over all rings; returns how many records it wrote.
+  auto drain() noexcept -> std::size_t
+  {
+    auto lock = std::lock_guard{mMutex};
+    auto count = std::size_t{0};
+    auto record = LogRecord{};
+    for (auto it = mRings.begin(); it != mRings.end();) {
+      auto& ring = **it;
+      // read before popping: once exited is seen, the producer's last push is visible too
+      auto const exited = ring.exited.load(std::memory_order_acquire);
+      while (ring.ring.pop(record)) {
+        appendRecord(record);
+        count += 1;
+      }
+      if (auto const dropped = ring.dropped.exchange(0, std::memory_order_relaxed); dropped != 0) {
+        std::format_to(std::back_inserter(mBuffer), "[{} log records dropped]\n", dropped);
+      }
+      it = exited ? mRings.erase(it) : it + 1;
+    }
+    panicWrite(mBuffer, mFd);
+    mBuffer.clear();
+    return count;
+  }
+
+  auto run() noexcept -> void
+  {
+    while (!mStopRequested.load(std::memory_order_relaxed)) {
+      if (drain() == 0) {
+        std::this_thread::sleep_for(mIdleSleep);
+      }
+    }
+  }
+
+  std::mutex mMutex; // registration and draining only, never taken by push
+  std::vector<std::unique_ptr<LogThreadRing>> mRings;
+  std::string mBuffer;
+  std::atomic<LogLevel> mLevel{LogLevel::Info};
+  int mFd;
+  std::chrono::microseconds mIdleSleep;
+  std::atomic_bool mStopRequested{false};
+  std::thread mThread;
+};
+
+template <LogArg... Args>
+auto log(LogLevel level, PanicFormat<std::type_identity_t<Args>...> fmt, Args&&... args) noexcept -> void
+{
+  auto& logger = Logger::global();
+  if (logger.enabled(level)) {
+    logger.push<std::decay_t<Args>...>(level, fmt.str.get(), fmt.loc, args...);
+  }
+}
+
+template <LogArg... Args>
+auto logInfo(PanicFormat<std::type_identity_t<Args>...> fmt, Args&&... args) noexcept -> void
+{
+  log<Args...>(LogLevel::Info, fmt, (Args &&) args...);
+}
+
+template <LogArg... Args>
+auto logWarn(PanicFormat<std::type_identity_t<Args>...> fmt, Args&&... args) noexcept -> void
+{
+  log<Args...>(LogLevel::Warn, fmt, (Args &&) args...);
+}
+
+template <LogArg... Args>
+auto logError(PanicFormat<std::type_identity_t<Args>...> fmt, Args&&... args) noexcept -> void
+{
+  log<Args...>(LogLevel::Error, fmt, (Args &&) args...);
+}
+
+#ifdef LOG_MAIN_FUNC
+int main()
+{
+  auto threads = std::vector<std::thread>{};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < 3; i++) {
+        logInfo("worker {} step {} of {:.1f}", t, i, 3.0);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  constexpr auto kOps = 1000;
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kOps; i++) {
+    logWarn("hot path {} {}", i, "literal");
+  }
+  auto const elapsed = std::chrono::steady_clock::now() - start;
+  Logger::global().flush();
+  logInfo("{} ns per log call", std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / kOps);
+  MY_CHECK(kOps == 1000, "unreachable");
+  MY_CHECK(kOps == 1, "ops was {}", kOps);
+}
+#endif
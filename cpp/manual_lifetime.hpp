@@ -1,4 +1,9 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <memory>
+#include <new>
 #include <type_traits>
 
 template <typename T>
@@ -33,4 +38,128 @@ private:
   union {
     T mStorage;
   };
-};
\ No newline at end of file
+};
+
+// Constructs T{args...} in every slot of [first, last). Value-initialized or copied trivially copyable types are
+// constructed once and then replicated with memcpy: no constructor runs that the copies could skip. Otherwise every
+// slot is constructed, and if a constructor throws the slots already built are destroyed again.
+template <typename T, typename... Args>
+auto constructRange(T* first, T* last, Args const&... args) -> void
+{
+  if (first == last) {
+    return;
+  }
+  constexpr auto kReplicate = std::is_trivially_copyable_v<T> &&
+                              ((sizeof...(Args) == 0 && std::is_trivially_default_constructible_v<T>) ||
+                               (sizeof...(Args) == 1 && (std::is_same_v<Args, T> && ...)));
+  if constexpr (kReplicate) {
+    ::new (static_cast<void*>(first)) T{args...};
+    auto const total = static_cast<std::size_t>(last - first);
+    // double the initialized prefix each step
+    for (auto done = std::size_t{1}; done < total;) {
+      auto const n = std::min(done, total - done);
+      std::memcpy(static_cast<void*>(first + done), static_cast<void const*>(first), n * sizeof(T));
+      done += n;
+    }
+  } else {
+    auto* cur = first;
+    try {
+      for (; cur != last; ++cur) {
+        ::new (static_cast<void*>(cur)) T{args...};
+      }
+    } catch (...) {
+      std::destroy(first, cur);
+      throw;
+    }
+  }
+}
+
+template <typename T>
+auto destroyRange(T* first, T* last) noexcept -> void
+{
+  if constexpr (!std::is_trivially_destructible_v<T>) {
+    std::destroy(first, last);
+  }
+}
+
+// N slots of deferred construction. Like ManualLifetime it does not track which slots are alive; the owner destroys
+// what it constructed.
+template <typename T, std::size_t N>
+class ManualLifetimeArray {
+public:
+  ManualLifetimeArray() noexcept {};
+  ~ManualLifetimeArray() {}
+  ManualLifetimeArray(ManualLifetimeArray const&) = delete;
+  ManualLifetimeArray& operator=(ManualLifetimeArray const&) = delete;
+  ManualLifetimeArray(ManualLifetimeArray&&) = delete;
+  ManualLifetimeArray& operator=(ManualLifetimeArray&&) = delete;
+
+  template <typename... Args>
+  auto construct(std::size_t i, Args&&... args) noexcept(std::is_nothrow_constructible_v<T, Args...>) -> T&
+  {
+    return *::new (static_cast<void*>(mStorage + i)) T{(Args &&) args...};
+  }
+  template <typename... Args>
+  auto constructRange(std::size_t first, std::size_t last, Args const&... args) -> void
+  {
+    ::constructRange(mStorage + first, mStorage + last, args...);
+  }
+  auto destruct(std::size_t i) noexcept -> void { std::destroy_at(mStorage + i); }
+  auto destroyRange(std::size_t first, std::size_t last) noexcept -> void
+  {
+    ::destroyRange(mStorage + first, mStorage + last);
+  }
+
+  auto operator[](std::size_t i) noexcept -> T& { return mStorage[i]; }
+  auto operator[](std::size_t i) const noexcept -> T const& { return mStorage[i]; }
+  auto data() noexcept -> T* { return mStorage; }
+  static constexpr auto size() noexcept -> std::size_t { return N; }
+
+private:
+  union {
+    T mStorage[N];
+  };
+};
+
+// Runtime-sized ManualLifetimeArray over storage from `Alloc`.
+template <typename T, typename Alloc = std::allocator<T>>
+class ManualLifetimeBuffer {
+  using Traits = std::allocator_traits<Alloc>;
+
+public:
+  explicit ManualLifetimeBuffer(std::size_t size, Alloc const& alloc = Alloc{})
+      : mAlloc(alloc), mData(Traits::allocate(mAlloc, size)), mSize(size)
+  {
+  }
+  ~ManualLifetimeBuffer() { Traits::deallocate(mAlloc, mData, mSize); }
+  ManualLifetimeBuffer(ManualLifetimeBuffer const&) = delete;
+  ManualLifetimeBuffer& operator=(ManualLifetimeBuffer const&) = delete;
+  ManualLifetimeBuffer(ManualLifetimeBuffer&&) = delete;
+  ManualLifetimeBuffer& operator=(ManualLifetimeBuffer&&) = delete;
+
+  template <typename... Args>
+  auto construct(std::size_t i, Args&&... args) noexcept(std::is_nothrow_constructible_v<T, Args...>) -> T&
+  {
+    return *::new (static_cast<void*>(mData + i)) T{(Args &&) args...};
+  }
+  template <typename... Args>
+  auto constructRange(std::size_t first, std::size_t last, Args const&... args) -> void
+  {
+    ::constructRange(mData + first, mData + last, args...);
+  }
+  auto destruct(std::size_t i) noexcept -> void { std::destroy_at(mData + i); }
+  auto destroyRange(std::size_t first, std::size_t last) noexcept -> void
+  {
+    ::destroyRange(mData + first, mData + last);
+  }
+
+  auto operator[](std::size_t i) noexcept -> T& { return mData[i]; }
+  auto operator[](std::size_t i) const noexcept -> T const& { return mData[i]; }
+  auto data() noexcept -> T* { return mData; }
+  auto size() const noexcept -> std::size_t { return mSize; }
+
+private:
+  [[no_unique_address]] Alloc mAlloc;
+  T* mData;
+  std::size_t mSize;
+};
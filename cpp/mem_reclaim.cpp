@@ -0,0 +1,567 @@
+#pragma once
+#include "atomic_queue.cpp"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Safe memory reclamation for lock-free structures: a node unlinked from a shared structure is retired instead of
+// freed, and reclaimed once no thread can still be reading it. HazardDomain tracks individual pointers, EpochDomain
+// tracks critical sections (EBR) or explicit quiescent points (QSBR).
+//
+// Domains must outlive every thread that used them; thread exit hands leftover retired nodes back to the domain.
+
+// Embedded in retirable nodes, same shape as TaskBase: a link plus a type-erased callback.
+struct RetiredNode {
+  RetiredNode* next{nullptr};
+  void (*reclaim)(RetiredNode* node) noexcept {nullptr};
+};
+
+template <std::derived_from<RetiredNode> Item>
+auto reclaimDelete(RetiredNode* node) noexcept -> void
+{
+  delete static_cast<Item*>(node);
+}
+
+using RetiredList = Queue<&RetiredNode::next>;
+
+inline auto reclaimAll(RetiredList list) noexcept -> std::size_t
+{
+  auto count = std::size_t{0};
+  while (!list.empty()) {
+    auto* node = list.popFront();
+    node->reclaim(node);
+    count += 1;
+  }
+  return count;
+}
+
+// Per-thread slot in a domain. Records are never unlinked; a thread takes a free one or appends a new one.
+struct ReclaimRecord {
+  ReclaimRecord* mNextRecord{nullptr};
+  std::atomic_bool mInUse{true};
+};
+
+template <typename Record>
+class ReclaimRegistry {
+public:
+  ~ReclaimRegistry() noexcept
+  {
+    auto* record = mHead.load(std::memory_order_acquire);
+    while (record != nullptr) {
+      delete static_cast<Record*>(std::exchange(record, record->mNextRecord));
+    }
+  }
+
+  auto acquire() -> Record*
+  {
+    for (auto* record = head(); record != nullptr; record = next(record)) {
+      auto expected = false;
+      if (!record->mInUse.load(std::memory_order_relaxed) &&
+          record->mInUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+        return record;
+      }
+    }
+    auto* record = new Record{};
+    auto* oldHead = mHead.load(std::memory_order_relaxed);
+    do {
+      record->mNextRecord = oldHead;
+    } while (!mHead.compare_exchange_weak(oldHead, record, std::memory_order_acq_rel));
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    return record;
+  }
+
+  auto head() const noexcept -> Record* { return static_cast<Record*>(mHead.load(std::memory_order_acquire)); }
+  static auto next(Record* record) noexcept -> Record* { return static_cast<Record*>(record->mNextRecord); }
+  auto size() const noexcept -> std::size_t { return mCount.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<ReclaimRecord*> mHead{nullptr};
+  std::atomic_size_t mCount{0};
+};
+
+// Thread-local binding of (domain, record) pairs, detached when the thread exits.
+class ReclaimAttachments {
+public:
+  struct Attachment {
+    Attachment* next;
+    void const* domain;
+    ReclaimRecord* record;
+    void (*detach)(void const* domain, ReclaimRecord* record) noexcept;
+  };
+
+  ~ReclaimAttachments() noexcept
+  {
+    while (mHead != nullptr) {
+      auto* attachment = std::exchange(mHead, mHead->next);
+      attachment->detach(attachment->domain, attachment->record);
+      delete attachment;
+    }
+  }
+
+  auto find(void const* domain) noexcept -> ReclaimRecord*
+  {
+    for (auto* attachment = mHead; attachment != nullptr; attachment = attachment->next) {
+      if (attachment->domain == domain) {
+        return attachment->record;
+      }
+    }
+    return nullptr;
+  }
+
+  auto add(void const* domain, ReclaimRecord* record, void (*detach)(void const*, ReclaimRecord*) noexcept) -> void
+  {
+    mHead = new Attachment{mHead, domain, record, detach};
+  }
+
+private:
+  Attachment* mHead{nullptr};
+};
+
+inline thread_local ReclaimAttachments tReclaimAttachments;
+
+class HazardDomain {
+public:
+  static constexpr std::size_t kSlotsPerThread = 4;
+  static constexpr std::size_t kMinScanThreshold = 64;
+
+  struct Record : ReclaimRecord {
+    std::atomic<void const*> mSlots[kSlotsPerThread]{};
+    std::uint32_t mFreeSlots{(1u << kSlotsPerThread) - 1};
+    RetiredList mRetired;
+    std::size_t mRetiredCount{0};
+  };
+
+  HazardDomain() = default;
+  HazardDomain(HazardDomain const&) = delete;
+  HazardDomain& operator=(HazardDomain const&) = delete;
+  ~HazardDomain() noexcept
+  {
+    reclaimAll(mOrphans.popAll());
+    for (auto* record = mRecords.head(); record != nullptr; record = mRecords.next(record)) {
+      reclaimAll(std::move(record->mRetired));
+    }
+  }
+
+  static auto global() noexcept -> HazardDomain&
+  {
+    static HazardDomain domain;
+    return domain;
+  }
+
+  auto record() -> Record*
+  {
+    if (auto* record = tReclaimAttachments.find(this); record != nullptr) [[likely]] {
+      return static_cast<Record*>(record);
+    }
+    auto* record = mRecords.acquire();
+    tReclaimAttachments.add(this, record, &HazardDomain::detach);
+    return record;
+  }
+
+  // Hands `node` over for reclamation once no hazard pointer protects it.
+  auto retire(RetiredNode* node) -> void
+  {
+    auto* self = record();
+    self->mRetired.pushBack(node);
+    self->mRetiredCount += 1;
+    if (self->mRetiredCount >= std::max(kMinScanThreshold, 2 * kSlotsPerThread * mRecords.size())) {
+      scan(self);
+    }
+  }
+
+  template <std::derived_from<RetiredNode> Item>
+  auto retire(Item* item) -> void
+  {
+    item->reclaim = &reclaimDelete<Item>;
+    retire(static_cast<RetiredNode*>(item));
+  }
+
+  // Reclaims every retired node of this thread that is not currently protected; returns how many were freed.
+  auto scan(Record* self) -> std::size_t
+  {
+    self->mRetired.append(mOrphans.popAll());
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    auto& hazards = tHazards;
+    hazards.clear();
+    for (auto* record = mRecords.head(); record != nullptr; record = mRecords.next(record)) {
+      for (auto& slot : record->mSlots) {
+        if (auto* p = slot.load(std::memory_order_acquire); p != nullptr) {
+          hazards.push_back(p);
+        }
+      }
+    }
+    std::sort(hazards.begin(), hazards.end());
+
+    auto kept = RetiredList{};
+    auto freed = RetiredList{};
+    auto keptCount = std::size_t{0};
+    while (!self->mRetired.empty()) {
+      auto* node = self->mRetired.popFront();
+      if (std::binary_search(hazards.begin(), hazards.end(), static_cast<void const*>(node))) {
+        kept.pushBack(node);
+        keptCount += 1;
+      } else {
+        freed.pushBack(node);
+      }
+    }
+    self->mRetired = std::move(kept);
+    self->mRetiredCount = keptCount;
+    return reclaimAll(std::move(freed));
+  }
+
+private:
+  static auto detach(void const* domain, ReclaimRecord* base) noexcept -> void
+  {
+    auto* self = static_cast<HazardDomain*>(const_cast<void*>(domain));
+    auto* record = static_cast<Record*>(base);
+    while (!record->mRetired.empty()) {
+      self->mOrphans.pushFront(record->mRetired.popFront());
+    }
+    record->mRetiredCount = 0;
+    record->mInUse.store(false, std::memory_order_release);
+  }
+
+  static inline thread_local std::vector<void const*> tHazards;
+
+  ReclaimRegistry<Record> mRecords;
+  AtomicQueue<&RetiredNode::next> mOrphans;
+};
+
+// Owns one hazard slot of the calling thread. Retired nodes are never reclaimed while a slot points at them.
+//
+// Nodes must be protected through the RetiredNode base address: protect() stores the pointer converted to
+// RetiredNode const* when T derives from it.
+class HazardPointer {
+public:
+  explicit HazardPointer(HazardDomain& domain = HazardDomain::global()) : mRecord(domain.record())
+  {
+    assert(mRecord->mFreeSlots != 0 && "out of hazard slots on this thread");
+    auto const idx = static_cast<std::size_t>(__builtin_ctz(mRecord->mFreeSlots));
+    mRecord->mFreeSlots &= ~(1u << idx);
+    mSlot = &mRecord->mSlots[idx];
+  }
+  HazardPointer(HazardPointer const&) = delete;
+  HazardPointer& operator=(HazardPointer const&) = delete;
+  ~HazardPointer() noexcept
+  {
+    reset();
+    mRecord->mFreeSlots |= 1u << static_cast<std::uint32_t>(mSlot - mRecord->mSlots);
+  }
+
+  // Loads `src` and publishes it until the published value is confirmed to still be current.
+  template <typename T>
+  auto protect(std::atomic<T*> const& src) noexcept -> T*
+  {
+    auto* p = src.load(std::memory_order_relaxed);
+    while (true) {
+      mSlot->store(erase(p), std::memory_order_seq_cst);
+      auto* current = src.load(std::memory_order_acquire);
+      if (current == p) {
+        return p;
+      }
+      p = current;
+    }
+  }
+
+  auto reset() noexcept -> void { mSlot->store(nullptr, std::memory_order_release); }
+
+private:
+  template <typename T>
+  static auto erase(T* p) noexcept -> void const*
+  {
+    if constexpr (std::derived_from<T, RetiredNode>) {
+      return static_cast<RetiredNode const*>(p);
+    } else {
+      return p;
+    }
+  }
+
+  HazardDomain::Record* mRecord;
+  std::atomic<void const*>* mSlot;
+};
+
+class EpochDomain {
+public:
+  static constexpr std::size_t kCollectThreshold = 64;
+
+  struct Record : ReclaimRecord {
+    // (epoch << 1) | 1 while pinned, 0 otherwise
+    std::atomic_uint64_t mState{0};
+    std::uint32_t mNesting{0};
+    RetiredList mRetired[3];
+    std::uint64_t mRetiredEpoch[3]{};
+    std::size_t mRetiredCount{0};
+  };
+
+  EpochDomain() = default;
+  EpochDomain(EpochDomain const&) = delete;
+  EpochDomain& operator=(EpochDomain const&) = delete;
+  ~EpochDomain() noexcept
+  {
+    auto orphans = mOrphans.popAll();
+    while (!orphans.empty()) {
+      auto* batch = orphans.popFront();
+      reclaimAll(std::move(batch->list));
+      delete batch;
+    }
+    for (auto* record = mRecords.head(); record != nullptr; record = mRecords.next(record)) {
+      for (auto& list : record->mRetired) {
+        reclaimAll(std::move(list));
+      }
+    }
+  }
+
+  static auto global() noexcept -> EpochDomain&
+  {
+    static EpochDomain domain;
+    return domain;
+  }
+
+  auto record() -> Record*
+  {
+    if (auto* record = tReclaimAttachments.find(this); record != nullptr) [[likely]] {
+      return static_cast<Record*>(record);
+    }
+    auto* record = mRecords.acquire();
+    tReclaimAttachments.add(this, record, &EpochDomain::detach);
+    return record;
+  }
+
+  auto pin(Record* self) noexcept -> void
+  {
+    if (self->mNesting++ == 0) {
+      announce(self);
+    }
+  }
+
+  auto unpin(Record* self) noexcept -> void
+  {
+    if (--self->mNesting == 0) {
+      self->mState.store(0, std::memory_order_release);
+    }
+  }
+
+  // QSBR: a thread that stays pinned for its whole loop calls this between operations, while it holds no
+  // references into shared structures, so the epoch can move past it.
+  auto quiescent() noexcept -> void
+  {
+    auto* self = record();
+    assert(self->mNesting > 0);
+    announce(self);
+    collect(self);
+  }
+
+  auto retire(RetiredNode* node) -> void
+  {
+    auto* self = record();
+    auto const epoch = mEpoch.load(std::memory_order_acquire);
+    auto const idx = epoch % 3;
+    if (self->mRetiredEpoch[idx] != epoch) {
+      // the bucket still holds epoch - 3, which is two epochs behind by now
+      self->mRetiredCount -= reclaimAll(std::move(self->mRetired[idx]));
+      self->mRetiredEpoch[idx] = epoch;
+    }
+    self->mRetired[idx].pushBack(node);
+    self->mRetiredCount += 1;
+    if (self->mRetiredCount >= kCollectThreshold) {
+      tryAdvance();
+      collect(self);
+    }
+  }
+
+  template <std::derived_from<RetiredNode> Item>
+  auto retire(Item* item) -> void
+  {
+    item->reclaim = &reclaimDelete<Item>;
+    retire(static_cast<RetiredNode*>(item));
+  }
+
+  // Moves the global epoch forward if every pinned thread has observed the current one.
+  auto tryAdvance() noexcept -> bool
+  {
+    auto epoch = mEpoch.load(std::memory_order_seq_cst);
+    for (auto* record = mRecords.head(); record != nullptr; record = mRecords.next(record)) {
+      auto const state = record->mState.load(std::memory_order_seq_cst);
+      if ((state & 1) != 0 && (state >> 1) != epoch) {
+        return false;
+      }
+    }
+    return mEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+  }
+
+  // Reclaims this thread's buckets (and orphaned batches) at least two epochs old; returns how many were freed.
+  auto collect(Record* self) -> std::size_t
+  {
+    auto const epoch = mEpoch.load(std::memory_order_acquire);
+    auto freed = std::size_t{0};
+    for (std::size_t i = 0; i < 3; i++) {
+      if (!self->mRetired[i].empty() && self->mRetiredEpoch[i] + 2 <= epoch) {
+        freed += reclaimAll(std::move(self->mRetired[i]));
+      }
+    }
+    self->mRetiredCount -= freed;
+
+    if (!mOrphans.empty()) {
+      auto orphans = mOrphans.popAll();
+      while (!orphans.empty()) {
+        auto* batch = orphans.popFront();
+        if (batch->epoch + 2 <= epoch) {
+          freed += reclaimAll(std::move(batch->list));
+          delete batch;
+        } else {
+          mOrphans.pushFront(batch);
+        }
+      }
+    }
+    return freed;
+  }
+
+  auto epoch() const noexcept -> std::uint64_t { return mEpoch.load(std::memory_order_relaxed); }
+
+private:
+  struct OrphanBatch {
+    OrphanBatch* next;
+    std::uint64_t epoch;
+    RetiredList list;
+  };
+
+  auto announce(Record* self) noexcept -> void
+  {
+    self->mState.store((mEpoch.load(std::memory_order_relaxed) << 1) | 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  static auto detach(void const* domain, ReclaimRecord* base) noexcept -> void
+  {
+    auto* self = static_cast<EpochDomain*>(const_cast<void*>(domain));
+    auto* record = static_cast<Record*>(base);
+    for (std::size_t i = 0; i < 3; i++) {
+      if (!record->mRetired[i].empty()) {
+        self->mOrphans.pushFront(new OrphanBatch{nullptr, record->mRetiredEpoch[i], std::move(record->mRetired[i])});
+      }
+    }
+    record->mRetiredCount = 0;
+    record->mNesting = 0;
+    record->mState.store(0, std::memory_order_release);
+    record->mInUse.store(false, std::memory_order_release);
+  }
+
+  std::atomic_uint64_t mEpoch{1};
+  ReclaimRegistry<Record> mRecords;
+  AtomicQueue<&OrphanBatch::next> mOrphans;
+};
+
+// Critical section of an EpochDomain: nodes retired after it started stay alive until it ends.
+class EpochGuard {
+public:
+  explicit EpochGuard(EpochDomain& domain = EpochDomain::global()) : mDomain(domain), mRecord(domain.record())
+  {
+    mDomain.pin(mRecord);
+  }
+  EpochGuard(EpochGuard const&) = delete;
+  EpochGuard& operator=(EpochGuard const&) = delete;
+  ~EpochGuard() noexcept { mDomain.unpin(mRecord); }
+
+private:
+  EpochDomain& mDomain;
+  EpochDomain::Record* mRecord;
+};
+
+#ifdef MEM_RECLAIM_MAIN_FUNC
+  #include <thread>
+
+constexpr auto kNumThreads = 8;
+constexpr auto kNumOps = 200'000;
+
+auto liveNodes = std::atomic_int{0};
+struct Node : RetiredNode {
+  Node(int v) : value(v) { liveNodes.fetch_add(1, std::memory_order_relaxed); }
+  ~Node() { liveNodes.fetch_sub(1, std::memory_order_relaxed); }
+  int value;
+  Node* link{nullptr};
+};
+
+// Treiber stack whose pop frees nodes while other threads may still be reading them.
+struct Stack {
+  auto push(Node* node) noexcept -> void
+  {
+    auto* oldHead = head.load(std::memory_order_relaxed);
+    do {
+      node->link = oldHead;
+    } while (!head.compare_exchange_weak(oldHead, node, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  auto popHazard(HazardDomain& domain) -> bool
+  {
+    auto hp = HazardPointer{domain};
+    while (true) {
+      auto* node = hp.protect(head);
+      if (node == nullptr) {
+        return false;
+      }
+      if (head.compare_exchange_weak(node, node->link, std::memory_order_acq_rel)) {
+        hp.reset();
+        domain.retire(node);
+        return true;
+      }
+    }
+  }
+
+  auto popEpoch(EpochDomain& domain) -> bool
+  {
+    auto guard = EpochGuard{domain};
+    auto* node = head.load(std::memory_order_acquire);
+    while (node != nullptr && !head.compare_exchange_weak(node, node->link, std::memory_order_acq_rel)) {
+    }
+    if (node == nullptr) {
+      return false;
+    }
+    domain.retire(node);
+    return true;
+  }
+
+  std::atomic<Node*> head{nullptr};
+};
+
+template <typename Domain, typename Pop>
+auto hammer(Domain& domain, Pop pop) -> void
+{
+  auto stack = Stack{};
+  auto threads = std::vector<std::thread>{};
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([&, i] {
+      for (int j = 0; j < kNumOps; j++) {
+        stack.push(new Node{i * kNumOps + j});
+        pop(stack, domain);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  while (pop(stack, domain)) {
+  }
+}
+
+auto main() -> int
+{
+  auto& hazards = HazardDomain::global();
+  hammer(hazards, [](Stack& s, HazardDomain& d) { return s.popHazard(d); });
+  hazards.scan(hazards.record());
+  assert(liveNodes.load() == 0);
+
+  auto& epochs = EpochDomain::global();
+  hammer(epochs, [](Stack& s, EpochDomain& d) { return s.popEpoch(d); });
+  for (int i = 0; i < 3; i++) {
+    epochs.tryAdvance();
+  }
+  epochs.collect(epochs.record());
+  assert(liveNodes.load() == 0);
+  ::puts("ok");
+}
+#endif
@@ -0,0 +1,223 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "atomic_queue.cpp"
+
+// Fixed-size object pool with per-thread magazines (Bonwick's magazine layer). Each thread caches two magazines of
+// up to MagazineSize free slots, so allocate/deallocate are pointer pops/pushes on thread-local arrays. Only when both
+// are empty (or full) does the thread trade a whole magazine with the global depot, which keeps full and empty
+// magazines in two TaggedAtomicStacks.
+//
+// One pool exists per (T, MagazineSize, Tag); slots and magazines are recycled and never returned to the system.
+template <typename T, std::size_t MagazineSize = 64, typename Tag = void>
+class ObjectPool {
+public:
+  static_assert(MagazineSize > 0, "MagazineSize > 0");
+
+  static auto allocate() -> void*
+  {
+    auto& cache = tCache;
+    if (cache.loaded == nullptr || cache.loaded->count == 0) [[unlikely]] {
+      cache.refillLoaded();
+    }
+    auto* m = cache.loaded;
+    return m->slots[--m->count];
+  }
+
+  static auto deallocate(void* p) noexcept -> void
+  {
+    auto& cache = tCache;
+    if (cache.loaded == nullptr || cache.loaded->count == MagazineSize) [[unlikely]] {
+      cache.drainLoaded();
+    }
+    auto* m = cache.loaded;
+    m->slots[m->count++] = static_cast<Slot*>(p);
+  }
+
+  template <typename... Us>
+  static auto create(Us&&... us) -> T*
+  {
+    auto* p = allocate();
+    try {
+      return ::new (p) T((Us &&) us...);
+    } catch (...) {
+      deallocate(p);
+      throw;
+    }
+  }
+
+  static auto destroy(T* object) noexcept -> void
+  {
+    std::destroy_at(object);
+    deallocate(object);
+  }
+
+private:
+  union Slot {
+    Slot* next;
+    alignas(T) std::byte storage[sizeof(T)];
+  };
+
+  struct Magazine {
+    Magazine* next;
+    std::size_t count;
+    Slot* slots[MagazineSize];
+  };
+
+  static auto depotFull() noexcept -> TaggedAtomicStack<&Magazine::next>&
+  {
+    static constinit auto stack = TaggedAtomicStack<&Magazine::next>{};
+    return stack;
+  }
+  static auto depotEmpty() noexcept -> TaggedAtomicStack<&Magazine::next>&
+  {
+    static constinit auto stack = TaggedAtomicStack<&Magazine::next>{};
+    return stack;
+  }
+
+  static auto emptyMagazine() -> Magazine*
+  {
+    if (auto* m = depotEmpty().popFront()) {
+      return m;
+    }
+    return new Magazine{nullptr, 0, {}};
+  }
+
+  // A magazine of never-used slots, carved from one allocation.
+  [[gnu::noinline]] static auto freshMagazine() -> Magazine*
+  {
+    auto* m = emptyMagazine();
+    auto* slots = static_cast<Slot*>(::operator new(sizeof(Slot) * MagazineSize, std::align_val_t{alignof(Slot)}));
+    for (std::size_t i = 0; i < MagazineSize; i++) {
+      m->slots[i] = slots + i;
+    }
+    m->count = MagazineSize;
+    return m;
+  }
+
+  static auto giveBack(Magazine* m) noexcept -> void
+  {
+    if (m != nullptr) {
+      (m->count != 0 ? depotFull() : depotEmpty()).pushFront(m);
+    }
+  }
+
+  struct ThreadCache {
+    // Makes `loaded` non-empty: swap with `previous` if that has slots, else trade the empty one for a full one.
+    [[gnu::noinline]] auto refillLoaded() -> void
+    {
+      if (previous != nullptr && previous->count != 0) {
+        std::swap(loaded, previous);
+        return;
+      }
+      auto* full = depotFull().popFront();
+      if (full == nullptr) {
+        full = freshMagazine();
+      }
+      giveBack(std::exchange(previous, loaded));
+      loaded = full;
+    }
+
+    // Makes `loaded` non-full: swap with `previous` if that has room, else hand the full one to the depot.
+    [[gnu::noinline]] auto drainLoaded() -> void
+    {
+      if (previous != nullptr && previous->count != MagazineSize) {
+        std::swap(loaded, previous);
+        return;
+      }
+      giveBack(std::exchange(previous, loaded));
+      loaded = emptyMagazine();
+    }
+
+    // Partially filled magazines go back to the full stack, a taker just sees fewer slots. Both pointers are cleared:
+    // a later destroy() on this thread (from another thread_local's destructor) must not write into a magazine the
+    // depot now hands to others, it takes a magazine of its own instead.
+    ~ThreadCache()
+    {
+      giveBack(std::exchange(loaded, nullptr));
+      giveBack(std::exchange(previous, nullptr));
+    }
+
+    Magazine* loaded{nullptr};
+    Magazine* previous{nullptr};
+  };
+
+  static inline thread_local ThreadCache tCache;
+};
+
+// Routes `new Derived(...)` / `delete` through ObjectPool<Derived>, e.g. `struct Message : PoolAllocated<Message>`.
+template <typename Derived, std::size_t MagazineSize = 64>
+struct PoolAllocated {
+  static auto operator new(std::size_t size) -> void*
+  {
+    assert(size == sizeof(Derived) && "derived classes of a PoolAllocated type need their own pool");
+    return ObjectPool<Derived, MagazineSize>::allocate();
+  }
+  static auto operator delete(void* p) noexcept -> void { ObjectPool<Derived, MagazineSize>::deallocate(p); }
+};
+
+#ifdef OBJECT_POOL_MAIN_FUNC
+  #include <chrono>
+  #include <cstdio>
+  #include <latch>
+  #include <thread>
+  #include <vector>
+
+struct Message : PoolAllocated<Message> {
+  std::uint64_t id;
+  std::uint64_t payload[7];
+};
+
+auto main() -> int
+{
+  constexpr auto kThreads = 8;
+  constexpr auto kRounds = 200;
+  constexpr auto kBatch = 1000;
+
+  // each thread churns through batches larger than its two magazines, so magazines keep moving through the depot
+  auto handoff = std::vector<std::vector<Message*>>(kThreads);
+  auto start = std::latch{kThreads + 1};
+  auto threads = std::vector<std::thread>{};
+  auto allocated = std::atomic_uint64_t{0};
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t] {
+      start.arrive_and_wait();
+      auto local = std::vector<Message*>{};
+      for (int r = 0; r < kRounds; r++) {
+        for (int i = 0; i < kBatch; i++) {
+          auto* m = new Message{};
+          m->id = static_cast<std::uint64_t>(t);
+          local.push_back(m);
+        }
+        for (auto* m : local) {
+          assert(m->id == static_cast<std::uint64_t>(t));
+          delete m;
+        }
+        local.clear();
+        allocated.fetch_add(kBatch, std::memory_order_relaxed);
+      }
+      for (int i = 0; i < kBatch; i++) {
+        handoff[t].push_back(new Message{});
+      }
+    });
+  }
+  auto const begin = std::chrono::steady_clock::now();
+  start.arrive_and_wait();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto const elapsed = std::chrono::steady_clock::now() - begin;
+  // free everything on the main thread, i.e. remotely
+  for (auto& v : handoff) {
+    for (auto* m : v) {
+      delete m;
+    }
+  }
+  auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  std::printf("%llu alloc/free pairs in %lld ms, %.1f M/s\n", (unsigned long long)allocated.load(),
+              (long long)(ns / 1'000'000), (double)allocated.load() * 1e3 / (double)ns);
+}
+#endif
@@ -1,9 +1,20 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
 #include <concepts>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
 #include <format>
 #include <source_location>
-#include <string>
 #include <string_view>
 
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "current_fiber.hpp"
+
 struct PanicDynamicStringView {
   template <class T>
     requires std::convertible_to<T, std::string_view>
@@ -28,29 +39,247 @@ struct PanicFormat {
   std::source_location loc;
 };
 
-[[noreturn]] auto panicImpl(char const* s) noexcept -> void;
+// Appends into a fixed buffer with no allocation and no locks, usable from signal handlers. Output that does not fit
+// is cut off.
+class PanicWriter {
+public:
+  static constexpr std::size_t kCapacity = 4096;
+
+  PanicWriter(char* buffer) noexcept : mBuffer(buffer) {}
+
+  auto append(std::string_view s) noexcept -> PanicWriter&
+  {
+    for (auto c : s) {
+      if (mSize == kCapacity) {
+        break;
+      }
+      mBuffer[mSize++] = c;
+    }
+    return *this;
+  }
+
+  auto appendUnsigned(std::uint64_t value, unsigned base = 10) noexcept -> PanicWriter&
+  {
+    char digits[20];
+    auto n = std::size_t{0};
+    do {
+      digits[n++] = "0123456789abcdef"[value % base];
+      value /= base;
+    } while (value != 0);
+    while (n != 0) {
+      append(std::string_view{&digits[--n], 1});
+    }
+    return *this;
+  }
+
+  auto appendHex(std::uintptr_t value) noexcept -> PanicWriter& { return append("0x").appendUnsigned(value, 16); }
+
+  // Output iterator for std::vformat_to, characters past the capacity are dropped.
+  struct Appender {
+    using difference_type = std::ptrdiff_t;
+
+    auto operator*() noexcept -> Appender& { return *this; }
+    auto operator++() noexcept -> Appender& { return *this; }
+    auto operator++(int) noexcept -> Appender { return *this; }
+    auto operator=(char c) noexcept -> Appender&
+    {
+      writer->append(std::string_view{&c, 1});
+      return *this;
+    }
+
+    PanicWriter* writer;
+  };
+
+  auto appender() noexcept -> Appender { return Appender{this}; }
+  auto view() const noexcept -> std::string_view { return {mBuffer, mSize}; }
+
+private:
+  char* mBuffer;
+  std::size_t mSize{0};
+};
+
+// Preallocated with the thread (static TLS), so panicking never needs the heap.
+inline thread_local char tPanicBuffer[PanicWriter::kCapacity];
+inline thread_local bool tPanicking = false;
+
+inline auto panicWrite(std::string_view s, int fd = STDERR_FILENO) noexcept -> void
+{
+  while (!s.empty()) {
+    auto const n = ::write(fd, s.data(), s.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    s.remove_prefix(static_cast<std::size_t>(n));
+  }
+}
+
+// Thread id, fiber id and a backtrace, written straight to stderr.
+inline auto panicDumpContext() noexcept -> void
+{
+  char buffer[128];
+  auto w = PanicWriter{buffer};
+  w.append("  thread ").appendUnsigned(static_cast<std::uint64_t>(::syscall(SYS_gettid)));
+  w.append(" fiber ").appendUnsigned(tCurrentFiberId).append("\n  backtrace:\n");
+  panicWrite(w.view());
+
+  void* frames[64];
+  auto const depth = ::backtrace(frames, 64);
+  ::backtrace_symbols_fd(frames, depth, STDERR_FILENO);
+}
+
+[[noreturn]] inline auto panicImpl(std::string_view msg) noexcept -> void
+{
+  panicWrite(msg);
+  panicDumpContext();
+  std::abort();
+}
+
+// Claims the thread's buffer; a panic while panicking (or from a handler interrupting one) bails out immediately.
+inline auto panicBegin() noexcept -> PanicWriter
+{
+  if (tPanicking) {
+    panicWrite("panic while panicking\n");
+    std::abort();
+  }
+  tPanicking = true;
+  return PanicWriter{tPanicBuffer};
+}
+
+inline auto panicLocation(PanicWriter& w, std::source_location loc) noexcept -> void
+{
+  w.append(loc.file_name()).append(":").appendUnsigned(loc.line()).append(" panic: ");
+}
+
+// The panic entry points below are out of line and cold: a call site compiles to a branch and one call, the
+// formatting code exists once per program instead of once per argument pack.
+[[noreturn, gnu::cold, gnu::noinline]] inline auto panicMessage(std::source_location loc, std::string_view msg) noexcept
+    -> void
+{
+  auto w = panicBegin();
+  panicLocation(w, loc);
+  w.append(msg).append("\n");
+  panicImpl(w.view());
+}
 
-[[noreturn]] inline auto panic(PanicDynamicStringView s) noexcept -> void
+// vformat_to writes into the preallocated buffer, no std::string is built. Argument types whose formatter allocates
+// still do; only panicMessage is async-signal-safe.
+[[noreturn, gnu::cold, gnu::noinline]] inline auto panicFormatted(std::source_location loc, std::string_view fmt,
+                                                                 std::format_args args) noexcept -> void
 {
-  auto msg = std::format("{}:{} panic: {}\n", s.loc.file_name(), s.loc.line(), s.str);
-  panicImpl(msg.c_str());
+  auto w = panicBegin();
+  panicLocation(w, loc);
+  std::vformat_to(w.appender(), fmt, args);
+  w.append("\n");
+  panicImpl(w.view());
 }
 
+[[noreturn]] inline auto panic(PanicDynamicStringView s) noexcept -> void { panicMessage(s.loc, s.str); }
+
 template <class... Args>
   requires(sizeof...(Args) > 0)
 [[noreturn]] auto panic(PanicFormat<std::type_identity_t<Args>...> fmt, Args&&... args) noexcept -> void
 {
-  auto msg = std::format("{}:{} panic: {}\n", fmt.loc.file_name(), fmt.loc.line(),
-                         std::format(fmt.fmt, std::forward<Args>(args)...));
-  panicImpl(msg.c_str());
+  panicFormatted(fmt.loc, fmt.str.get(), std::make_format_args(args...));
 }
 
-[[noreturn]] auto panicImpl(char const* s) noexcept -> void
+// Run by a failed MY_CHECK before it panics, e.g. to write out queued log records (log.cpp installs one). panic()
+// itself never runs it: panicMessage has to stay async-signal-safe.
+inline constinit std::atomic<auto (*)() noexcept->void> gPanicCheckHook{nullptr};
+
+[[gnu::cold, gnu::noinline]] inline auto panicRunCheckHook() noexcept -> void
 {
-  std::fputs(s, stderr);
-  std::abort();
+  if (auto* hook = gPanicCheckHook.load(std::memory_order_acquire); hook != nullptr && !tPanicking) {
+    hook();
+  }
+}
+
+// Checks `cond` on the hot path and panics with the remaining arguments (a format string and its arguments)
+// otherwise. The failure branch is marked unlikely and only contains the cold calls.
+#define MY_CHECK(cond, ...)                                                                                            \
+  do {                                                                                                                 \
+    if (!(cond)) [[unlikely]] {                                                                                        \
+      panicRunCheckHook();                                                                                             \
+      panic(__VA_ARGS__);                                                                                              \
+    }                                                                                                                  \
+  } while (false)
+
+inline auto panicSignalName(int sig) noexcept -> std::string_view
+{
+  switch (sig) {
+  case SIGSEGV:
+    return "SIGSEGV";
+  case SIGBUS:
+    return "SIGBUS";
+  case SIGILL:
+    return "SIGILL";
+  case SIGFPE:
+    return "SIGFPE";
+  default:
+    return "signal";
+  }
 }
 
-int main() {
+inline auto panicSignalHandler(int sig, siginfo_t* info, void*) noexcept -> void
+{
+  if (!tPanicking) {
+    tPanicking = true;
+    auto w = PanicWriter{tPanicBuffer};
+    w.append("fatal ").append(panicSignalName(sig)).append(" (").appendUnsigned(static_cast<std::uint64_t>(sig));
+    w.append(") at address ").appendHex(reinterpret_cast<std::uintptr_t>(info->si_addr)).append("\n");
+    panicWrite(w.view());
+    panicDumpContext();
+  }
+  // re-raise with the default action so the process still dumps core with the original signal
+  ::signal(sig, SIG_DFL);
+  ::raise(sig);
+}
+
+// Gives the calling thread a preallocated signal stack so a stack overflow can still be reported. Call it on every
+// thread that should survive overflowing its own stack.
+inline auto installPanicAltStack() noexcept -> bool
+{
+  static thread_local char altStack[64 * 1024];
+  auto ss = stack_t{};
+  ss.ss_sp = altStack;
+  ss.ss_size = sizeof(altStack);
+  ss.ss_flags = 0;
+  return ::sigaltstack(&ss, nullptr) == 0;
+}
+
+// Routes SIGSEGV/SIGBUS/SIGILL/SIGFPE through the panic path. Process-wide, call once early in main.
+inline auto installPanicSignalHandlers() noexcept -> bool
+{
+  // the first backtrace() loads libgcc, which allocates; do it now rather than inside a handler
+  void* frame;
+  ::backtrace(&frame, 1);
+  installPanicAltStack();
+
+  struct sigaction action {};
+  action.sa_sigaction = &panicSignalHandler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  ::sigemptyset(&action.sa_mask);
+  for (auto sig : {SIGSEGV, SIGBUS, SIGILL, SIGFPE}) {
+    if (::sigaction(sig, &action, nullptr) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef PANIC_MAIN_FUNC
+int main(int argc, char** argv)
+{
+  installPanicSignalHandlers();
+  if (argc > 1 && std::string_view{argv[1]} == "segv") {
+    *static_cast<int volatile*>(nullptr) = 1;
+  }
+  if (argc > 1 && std::string_view{argv[1]} == "format") {
+    panic("bad index {} of {}", 7, 3);
+  }
+  MY_CHECK(argc < 3, "too many arguments: {}", argc);
   panic("Hello, world!");
-}
\ No newline at end of file
+}
+#endif
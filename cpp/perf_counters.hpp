@@ -0,0 +1,485 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+// Hot-path profiling with hardware counters. Every thread opens its own perf_event_open group (cycles, instructions,
+// cache misses, branch misses, user space only) the first time it enters a PerfScope. Scopes read the counters with
+// rdpmc from the event's mmap page, so there is no syscall on the hot path, and add the deltas to per-thread totals
+// keyed by a TraceSite or by a task's run function. PerfProfiler::report() merges the totals of all threads.
+//
+// Where perf events are not permitted (containers, perf_event_paranoid > 2, no PMU in the VM) scopes only record
+// wall-clock time. While profiling is disabled each scope costs one load and one predictable branch.
+//
+// Task types are named with dladdr(); link with -rdynamic to get names instead of addresses.
+
+enum class PerfCounter : std::uint8_t { Cycles, Instructions, CacheMisses, BranchMisses };
+constexpr std::size_t kPerfCounterCount = 4;
+
+struct PerfTotals {
+  std::uint64_t calls{0};
+  std::uint64_t ns{0};
+  std::uint64_t counters[kPerfCounterCount]{};
+  std::uint8_t counterMask{(1u << kPerfCounterCount) - 1}; // counters measured by every contributing thread
+
+  auto add(PerfTotals const& other) noexcept -> void
+  {
+    calls += other.calls;
+    ns += other.ns;
+    for (std::size_t i = 0; i < kPerfCounterCount; i++) {
+      counters[i] += other.counters[i];
+    }
+    counterMask &= other.counterMask;
+  }
+};
+
+// A scope is attributed either to a TraceSite (queue operations and other named regions) or to a code address (the
+// `run` function of a task type).
+struct PerfKey {
+  void const* address;
+  bool isSite;
+
+  auto operator==(PerfKey const&) const noexcept -> bool = default;
+};
+
+struct PerfKeyHash {
+  auto operator()(PerfKey const& key) const noexcept -> std::size_t
+  {
+    return std::hash<void const*>{}(key.address) ^ static_cast<std::size_t>(key.isSite);
+  }
+};
+
+struct PerfSample {
+  std::uint64_t ns;
+  std::uint64_t counters[kPerfCounterCount];
+};
+
+class PerfThreadCounters {
+public:
+  PerfThreadCounters() noexcept
+  {
+    static constexpr std::uint64_t kConfigs[kPerfCounterCount] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    auto const pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    for (std::size_t i = 0; i < kPerfCounterCount; i++) {
+      auto attr = perf_event_attr{};
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = kConfigs[i];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      // the cycles counter leads the group so all four are scheduled onto the PMU together
+      auto const fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : mFds[0], 0));
+      if (fd < 0) {
+        if (i == 0) {
+          return;
+        }
+        continue;
+      }
+      mFds[i] = fd;
+      mMask |= static_cast<std::uint8_t>(1u << i);
+      if (auto* page = ::mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, fd, 0); page != MAP_FAILED) {
+        mPages[i] = static_cast<perf_event_mmap_page*>(page);
+      }
+    }
+  }
+  PerfThreadCounters(PerfThreadCounters const&) = delete;
+  PerfThreadCounters& operator=(PerfThreadCounters const&) = delete;
+  ~PerfThreadCounters() { close(); }
+
+  // Releases the events; later reads only take timestamps.
+  auto close() noexcept -> void
+  {
+    auto const pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    for (std::size_t i = kPerfCounterCount; i-- > 0;) {
+      if (mPages[i] != nullptr) {
+        ::munmap(const_cast<perf_event_mmap_page*>(mPages[i]), pageSize);
+        mPages[i] = nullptr;
+      }
+      if (mFds[i] >= 0) {
+        ::close(std::exchange(mFds[i], -1));
+      }
+    }
+    mMask = 0;
+  }
+
+  // Bit i is set when PerfCounter i could be opened; 0 means timestamps only.
+  auto mask() const noexcept -> std::uint8_t { return mMask; }
+
+  auto read(PerfSample& sample) const noexcept -> void
+  {
+    for (std::size_t i = 0; i < kPerfCounterCount; i++) {
+      if (mMask & (1u << i)) {
+        sample.counters[i] = readCounter(i);
+      }
+    }
+    sample.ns = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+private:
+  // The kernel publishes the running count as `offset` plus the live PMC value, guarded by a sequence lock. When
+  // rdpmc is not allowed to user space, or the event is not on the PMU right now (index 0), fall back to read(2).
+  auto readCounter(std::size_t i) const noexcept -> std::uint64_t
+  {
+#if defined(MY_TRACE_RDTSC)
+    if (auto const* page = mPages[i]; page != nullptr) {
+      std::uint32_t seq = 0;
+      std::uint64_t value = 0;
+      auto mapped = true;
+      do {
+        seq = page->lock;
+        std::atomic_signal_fence(std::memory_order_acquire);
+        auto const index = page->index;
+        if (!page->cap_user_rdpmc || index == 0) {
+          mapped = false;
+          break;
+        }
+        auto const width = page->pmc_width;
+        auto pmc = static_cast<std::int64_t>(__rdpmc(static_cast<int>(index - 1)));
+        pmc = static_cast<std::int64_t>(static_cast<std::uint64_t>(pmc) << (64 - width)) >> (64 - width);
+        value = page->offset + static_cast<std::uint64_t>(pmc);
+        std::atomic_signal_fence(std::memory_order_acquire);
+      } while (page->lock != seq);
+      if (mapped) {
+        return value;
+      }
+    }
+#endif
+    auto value = std::uint64_t{0};
+    return ::read(mFds[i], &value, sizeof(value)) == sizeof(value) ? value : 0;
+  }
+
+  int mFds[kPerfCounterCount]{-1, -1, -1, -1};
+  perf_event_mmap_page const volatile* mPages[kPerfCounterCount]{};
+  std::uint8_t mMask{0};
+};
+
+// One region's totals on one thread. Only the owning thread adds to a slot, so plain relaxed loads and stores are
+// enough; report() reads them concurrently and may see one scope's fields half updated.
+struct PerfSlot {
+  std::atomic<std::uint64_t> calls{0};
+  std::atomic<std::uint64_t> ns{0};
+  std::atomic<std::uint64_t> counters[kPerfCounterCount]{};
+  std::atomic<std::uint8_t> counterMask{(1u << kPerfCounterCount) - 1};
+
+  auto add(PerfSample const& begin, PerfSample const& end, std::uint8_t mask) noexcept -> void
+  {
+    calls.store(calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    ns.store(ns.load(std::memory_order_relaxed) + (end.ns - begin.ns), std::memory_order_relaxed);
+    for (std::size_t i = 0; i < kPerfCounterCount; i++) {
+      auto const delta = end.counters[i] - begin.counters[i];
+      counters[i].store(counters[i].load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    counterMask.store(counterMask.load(std::memory_order_relaxed) & mask, std::memory_order_relaxed);
+  }
+
+  auto totals() const noexcept -> PerfTotals
+  {
+    auto result = PerfTotals{};
+    result.calls = calls.load(std::memory_order_relaxed);
+    result.ns = ns.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < kPerfCounterCount; i++) {
+      result.counters[i] = counters[i].load(std::memory_order_relaxed);
+    }
+    result.counterMask = counterMask.load(std::memory_order_relaxed);
+    return result;
+  }
+
+  auto reset() noexcept -> void
+  {
+    calls.store(0, std::memory_order_relaxed);
+    ns.store(0, std::memory_order_relaxed);
+    for (auto& counter : counters) {
+      counter.store(0, std::memory_order_relaxed);
+    }
+    counterMask.store((1u << kPerfCounterCount) - 1, std::memory_order_relaxed);
+  }
+};
+
+struct PerfThreadState {
+  PerfThreadCounters counters;
+  // Only the owning thread inserts into `slots`, and only under `mutex`, so it looks keys up without the lock.
+  // report() and clear() take it to walk the map; adding to an existing slot never does.
+  std::mutex mutex;
+  std::unordered_map<PerfKey, PerfSlot, PerfKeyHash> slots;
+};
+
+class PerfProfiler;
+
+// Counters are closed when the thread exits, its totals stay with the profiler.
+struct PerfThreadHandle {
+  ~PerfThreadHandle();
+
+  PerfThreadState* state{nullptr};
+};
+
+inline thread_local PerfThreadHandle tPerfThread;
+
+class PerfProfiler {
+public:
+  constexpr PerfProfiler() noexcept = default;
+  PerfProfiler(PerfProfiler const&) = delete;
+  PerfProfiler& operator=(PerfProfiler const&) = delete;
+
+  auto enabled() const noexcept -> bool { return mEnabled.load(std::memory_order_relaxed); }
+  auto enable() noexcept -> void { mEnabled.store(true, std::memory_order_relaxed); }
+  auto disable() noexcept -> void { mEnabled.store(false, std::memory_order_relaxed); }
+
+  auto threadState() -> PerfThreadState&
+  {
+    if (tPerfThread.state == nullptr) [[unlikely]] {
+      auto state = std::make_unique<PerfThreadState>();
+      auto lock = std::lock_guard{mMutex};
+      tPerfThread.state = mStates.emplace_back(std::move(state)).get();
+    }
+    return *tPerfThread.state;
+  }
+
+  // One row per region, sorted by total time. Safe while other threads keep profiling.
+  auto report(std::FILE* out = stderr) -> void
+  {
+    auto merged = std::unordered_map<PerfKey, PerfTotals, PerfKeyHash>{};
+    {
+      auto lock = std::lock_guard{mMutex};
+      for (auto& state : mStates) {
+        auto stateLock = std::lock_guard{state->mutex};
+        for (auto const& [key, slot] : state->slots) {
+          merged[key].add(slot.totals());
+        }
+      }
+    }
+    auto rows = std::vector<std::pair<std::string, PerfTotals>>{};
+    for (auto const& [key, totals] : merged) {
+      rows.emplace_back(regionName(key), totals);
+    }
+    std::sort(rows.begin(), rows.end(), [](auto const& a, auto const& b) { return a.second.ns > b.second.ns; });
+
+    std::fprintf(out, "%-48s %10s %10s %12s %6s %12s %12s\n", "region", "calls", "ns/call", "cycles/call", "IPC",
+                 "cmiss/call", "bmiss/call");
+    for (auto const& [name, t] : rows) {
+      auto const calls = static_cast<double>(std::max<std::uint64_t>(t.calls, 1));
+      auto column = [&](char* buffer, std::size_t size, PerfCounter counter) {
+        auto const i = static_cast<std::size_t>(counter);
+        if (t.counterMask & (1u << i)) {
+          std::snprintf(buffer, size, "%.1f", static_cast<double>(t.counters[i]) / calls);
+        } else {
+          std::snprintf(buffer, size, "-");
+        }
+      };
+      char cycles[32], cacheMisses[32], branchMisses[32], ipc[32];
+      column(cycles, sizeof(cycles), PerfCounter::Cycles);
+      column(cacheMisses, sizeof(cacheMisses), PerfCounter::CacheMisses);
+      column(branchMisses, sizeof(branchMisses), PerfCounter::BranchMisses);
+      if ((t.counterMask & 0b11) == 0b11 && t.counters[0] != 0) {
+        auto const instructions = static_cast<double>(t.counters[1]);
+        std::snprintf(ipc, sizeof(ipc), "%.2f", instructions / static_cast<double>(t.counters[0]));
+      } else {
+        std::snprintf(ipc, sizeof(ipc), "-");
+      }
+      std::fprintf(out, "%-48.48s %10llu %10.1f %12s %6s %12s %12s\n", name.c_str(), (unsigned long long)t.calls,
+                   static_cast<double>(t.ns) / calls, cycles, ipc, cacheMisses, branchMisses);
+    }
+  }
+
+  // Zeroes all totals; only call while no thread is profiling. Slots stay allocated, their owners hold no lock.
+  auto clear() noexcept -> void
+  {
+    auto lock = std::lock_guard{mMutex};
+    for (auto& state : mStates) {
+      auto stateLock = std::lock_guard{state->mutex};
+      for (auto& [key, slot] : state->slots) {
+        slot.reset();
+      }
+    }
+  }
+
+private:
+  static auto regionName(PerfKey const& key) -> std::string
+  {
+    if (key.isSite) {
+      auto const* site = static_cast<TraceSite const*>(key.address);
+      return std::string(site->category) + "::" + std::string(site->name);
+    }
+    auto info = Dl_info{};
+    if (::dladdr(key.address, &info) != 0 && info.dli_sname != nullptr) {
+      auto status = 0;
+      auto* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+      auto name = std::string(status == 0 ? demangled : info.dli_sname);
+      std::free(demangled);
+      return name;
+    }
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "task %p", key.address);
+    return buffer;
+  }
+
+  std::atomic_bool mEnabled{false};
+  std::mutex mMutex;
+  std::vector<std::unique_ptr<PerfThreadState>> mStates;
+};
+
+inline constinit PerfProfiler gProfiler{};
+
+inline PerfThreadHandle::~PerfThreadHandle()
+{
+  if (state != nullptr) {
+    auto lock = std::lock_guard{state->mutex};
+    state->counters.close();
+  }
+}
+
+// Out of line so the disabled path stays a single branch at every scope.
+[[gnu::noinline]] inline auto perfBegin(PerfSample& sample) noexcept -> PerfThreadState*
+{
+  auto& state = gProfiler.threadState();
+  state.counters.read(sample);
+  return &state;
+}
+
+[[gnu::noinline]] inline auto perfEnd(PerfThreadState& state, PerfKey key, PerfSample const& begin) noexcept -> void
+{
+  auto end = PerfSample{};
+  state.counters.read(end);
+  auto slot = state.slots.find(key);
+  if (slot == state.slots.end()) [[unlikely]] {
+    auto lock = std::lock_guard{state.mutex};
+    slot = state.slots.try_emplace(key).first;
+  }
+  slot->second.add(begin, end, state.counters.mask());
+}
+
+// Measures the enclosing block, including nested scopes. A scope that began while profiling was enabled is always
+// accounted for.
+class PerfScope {
+public:
+  explicit PerfScope(TraceSite const& site) noexcept : mKey{&site, true} { begin(); }
+  template <typename F>
+    requires std::is_function_v<F>
+  explicit PerfScope(F* function) noexcept : mKey{reinterpret_cast<void const*>(function), false}
+  {
+    begin();
+  }
+  PerfScope(PerfScope const&) = delete;
+  PerfScope& operator=(PerfScope const&) = delete;
+  ~PerfScope() noexcept
+  {
+    if (mState != nullptr) [[unlikely]] {
+      perfEnd(*mState, mKey, mBegin);
+    }
+  }
+
+private:
+  auto begin() noexcept -> void
+  {
+    if (gProfiler.enabled()) [[unlikely]] {
+      mState = perfBegin(mBegin);
+    }
+  }
+
+  PerfKey mKey;
+  PerfThreadState* mState{nullptr};
+  PerfSample mBegin;
+};
+
+#ifdef PERF_COUNTERS_MAIN_FUNC
+  #include "static_thread_pool.cpp"
+  #include <latch>
+
+struct SumTask : TaskBase {
+  SumTask() : TaskBase{nullptr, &SumTask::run} {}
+  static auto run(TaskBase* task, std::uint32_t) noexcept -> void
+  {
+    auto* t = static_cast<SumTask*>(task);
+    for (std::uint64_t i = 0; i < 10'000; i++) {
+      t->sum += i * i;
+    }
+    t->done->count_down();
+  }
+  std::uint64_t sum{0};
+  std::latch* done{nullptr};
+};
+
+struct ChaseTask : TaskBase {
+  ChaseTask() : TaskBase{nullptr, &ChaseTask::run} {}
+  // dependent loads over a shuffled 8 MiB array: mostly cache misses
+  static auto run(TaskBase* task, std::uint32_t) noexcept -> void
+  {
+    auto* t = static_cast<ChaseTask*>(task);
+    auto index = std::uint32_t{0};
+    for (int i = 0; i < 10'000; i++) {
+      index = (*t->next)[index];
+    }
+    t->sum += index;
+    t->done->count_down();
+  }
+  std::vector<std::uint32_t> const* next{nullptr};
+  std::uint64_t sum{0};
+  std::latch* done{nullptr};
+};
+
+constexpr auto kDemoScope = TraceSite{"scope overhead", "demo"};
+
+auto main() -> int
+{
+  constexpr auto kTasks = 2000;
+  auto next = std::vector<std::uint32_t>(std::size_t{1} << 21);
+  auto seed = std::uint64_t{42};
+  for (std::uint32_t i = 0; i < next.size(); i++) {
+    next[i] = i;
+  }
+  for (auto i = next.size() - 1; i > 0; i--) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    std::swap(next[i], next[(seed >> 33) % (i + 1)]);
+  }
+
+  gProfiler.enable();
+  auto sums = std::vector<SumTask>(kTasks);
+  auto chases = std::vector<ChaseTask>(kTasks);
+  auto done = std::latch{2 * kTasks};
+  {
+    auto pool = StaticThreadPool(4);
+    for (int i = 0; i < kTasks; i++) {
+      sums[i].done = &done;
+      chases[i].done = &done;
+      chases[i].next = &next;
+      pool.enqueue(&sums[i]);
+      pool.enqueue(&chases[i]);
+    }
+    done.wait();
+  }
+
+  for (int i = 0; i < 100'000; i++) {
+    auto scope = PerfScope{kDemoScope};
+  }
+  gProfiler.disable();
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 10'000'000; i++) {
+    auto scope = PerfScope{kDemoScope};
+  }
+  auto const elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  std::fprintf(stderr, "disabled scope: %.2f ns\n", elapsed / 1e7);
+  gProfiler.report(stdout);
+}
+#endif
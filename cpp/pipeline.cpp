@@ -0,0 +1,493 @@
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+#endif
+
+#include "spsc_fifo_ring.hpp"
+
+// Staged pipeline: every stage runs on its own dedicated (optionally pinned) threads and stages talk only through
+// bounded single-producer single-consumer FIFO rings. Between two stages there is one ring per (upstream thread,
+// downstream thread) pair, so a stage fed by several threads fans in without any read-modify-write on the hot path.
+// Items move in batches: a stage pops up to `batch` items from a ring with one cursor store, and its outputs are
+// buffered and pushed downstream with one cursor store per ring. A full downstream ring stalls the upstream thread
+// (spin, then yield) instead of growing a queue, so a slow stage throttles everything before it.
+//
+// Usage:
+//   auto pipeline = PipelineBuilder<Line>(producers)
+//                       .stage<Record>("parse", [](Line& l, auto& out) { out.emit(parse(l)); }, {.threads = 2})
+//                       .sink("store", [](Record& r) { store(r); });
+//   pipeline.start();
+//   // thread i: pipeline.producer(i).emit(line) ..., then pipeline.producer(i).close()
+//   pipeline.join();
+//   pipeline.report(stdout);
+//
+// Items of one upstream thread reach a single-threaded stage in emission order; a multi-threaded stage spreads them
+// round-robin over its threads.
+struct StageOptions {
+  std::uint32_t threads{1};
+  std::vector<int> cpus{}; // thread i runs on cpus[i % cpus.size()], empty leaves placement to the OS
+  std::uint32_t batch{64};
+};
+
+// Written only by the thread it belongs to, read once the pipeline has joined.
+struct alignas(64) PipelineMetrics {
+  std::uint64_t itemsIn{0};
+  std::uint64_t itemsOut{0};
+  std::uint64_t batches{0};
+  std::uint64_t stalls{0}; // flushes that found every downstream ring full
+  std::uint64_t occupancySum{0}; // input ring sizes seen before each pop
+  std::uint64_t occupancySamples{0};
+  std::chrono::steady_clock::time_point finished{};
+};
+
+inline auto pipelineBackoff(std::uint32_t& spins) noexcept -> void
+{
+  if (spins < 64) {
+    spins++;
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+  } else {
+    std::this_thread::yield();
+  }
+}
+
+// Rings from `producers` upstream threads to `consumers` downstream threads, plus the count of upstream threads that
+// have not closed yet.
+template <typename T, std::size_t Capacity>
+class PipelineChannel {
+public:
+  using Ring = FIFO<T, Capacity>;
+
+  PipelineChannel(std::uint32_t producers, std::uint32_t consumers)
+      : mProducers(producers), mConsumers(consumers), mRings(producers * consumers), mOpen(producers)
+  {
+    for (auto& ring : mRings) {
+      ring = std::make_unique<Ring>();
+    }
+  }
+
+  auto ring(std::uint32_t producer, std::uint32_t consumer) noexcept -> Ring&
+  {
+    return *mRings[producer * mConsumers + consumer];
+  }
+  auto producers() const noexcept -> std::uint32_t { return mProducers; }
+  auto consumers() const noexcept -> std::uint32_t { return mConsumers; }
+  // Everything an upstream thread pushed happens-before its close, so once this returns true a pass over the rings
+  // that finds them empty is final.
+  auto closed() const noexcept -> bool { return mOpen.load(std::memory_order_acquire) == 0; }
+  auto close() noexcept -> void { mOpen.fetch_sub(1, std::memory_order_release); }
+
+private:
+  std::uint32_t mProducers;
+  std::uint32_t mConsumers;
+  std::vector<std::unique_ptr<Ring>> mRings;
+  std::atomic_uint32_t mOpen;
+};
+
+// Output side of one upstream thread: buffers up to `batch` items, then pushes them round-robin over the downstream
+// threads' rings.
+template <typename T, std::size_t Capacity>
+class PipelineEmitter {
+public:
+  PipelineEmitter(PipelineChannel<T, Capacity>& channel, std::uint32_t producer, std::uint32_t batch,
+                  PipelineMetrics& metrics)
+      : mChannel(channel), mProducer(producer), mBatch(std::max(batch, 1u)), mMetrics(metrics)
+  {
+    mBuffer.reserve(mBatch);
+  }
+  PipelineEmitter(PipelineEmitter const&) = delete;
+  PipelineEmitter& operator=(PipelineEmitter const&) = delete;
+
+  template <typename... Args>
+  auto emit(Args&&... args) -> void
+  {
+    mBuffer.emplace_back((Args &&) args...);
+    mMetrics.itemsOut += 1;
+    if (mBuffer.size() == mBatch) {
+      flush();
+    }
+  }
+
+  // Blocks while every downstream ring is full.
+  auto flush() -> void
+  {
+    auto sent = std::size_t{0};
+    auto spins = std::uint32_t{0};
+    auto blocked = std::uint32_t{0};
+    while (sent != mBuffer.size()) {
+      auto& ring = mChannel.ring(mProducer, mNext);
+      mNext = mNext + 1 == mChannel.consumers() ? 0 : mNext + 1;
+      auto const n = ring.pushBatch(mBuffer.data() + sent, mBuffer.size() - sent);
+      sent += n;
+      if (n != 0) {
+        blocked = 0;
+        spins = 0;
+      } else if (++blocked == mChannel.consumers()) {
+        blocked = 0;
+        mMetrics.stalls += 1;
+        pipelineBackoff(spins);
+      }
+    }
+    mBuffer.clear();
+  }
+
+  // Flushes and tells the downstream stage this thread is done; call exactly once.
+  auto close() -> void
+  {
+    flush();
+    mChannel.close();
+  }
+
+private:
+  PipelineChannel<T, Capacity>& mChannel;
+  std::uint32_t mProducer;
+  std::uint32_t mBatch;
+  std::uint32_t mNext{0};
+  PipelineMetrics& mMetrics;
+  std::vector<T> mBuffer;
+};
+
+class PipelineStageBase {
+public:
+  PipelineStageBase(std::string name, StageOptions options)
+      : mName(std::move(name)), mOptions(std::move(options)), mMetrics(mOptions.threads)
+  {
+  }
+  virtual ~PipelineStageBase() = default;
+  virtual auto work(std::uint32_t worker) -> void = 0;
+  virtual auto capacity() const noexcept -> std::size_t = 0;
+
+  auto name() const noexcept -> std::string const& { return mName; }
+  auto options() const noexcept -> StageOptions const& { return mOptions; }
+  auto metrics() const noexcept -> std::vector<PipelineMetrics> const& { return mMetrics; }
+
+protected:
+  std::string mName;
+  StageOptions mOptions;
+  std::vector<PipelineMetrics> mMetrics;
+};
+
+// `Out` is void for a sink. The stage owns its input channel; the next stage hands it the output channel.
+template <typename In, typename Out, std::size_t Capacity, typename F>
+class PipelineStage final : public PipelineStageBase {
+public:
+  PipelineStage(std::string name, F fn, StageOptions options, std::uint32_t upstream)
+      : PipelineStageBase(std::move(name), std::move(options)), mFn(std::move(fn)),
+        mInput(std::make_unique<PipelineChannel<In, Capacity>>(upstream, mOptions.threads))
+  {
+  }
+
+  auto input() noexcept -> PipelineChannel<In, Capacity>& { return *mInput; }
+  auto capacity() const noexcept -> std::size_t override { return PipelineChannel<In, Capacity>::Ring::capacity(); }
+
+  auto work(std::uint32_t worker) -> void override
+  {
+    auto& metrics = mMetrics[worker];
+    if constexpr (std::is_void_v<Out>) {
+      drain(worker, metrics, [&](In& item) { mFn(item); }, [] {});
+    } else {
+      auto emitter = PipelineEmitter<Out, Capacity>(*mOutput, worker, mOptions.batch, metrics);
+      // a partial batch goes downstream after every pass, so items never wait in the buffer while input is idle
+      drain(worker, metrics, [&](In& item) { mFn(item, emitter); }, [&] { emitter.flush(); });
+      emitter.close();
+    }
+    metrics.finished = std::chrono::steady_clock::now();
+  }
+
+  // input of the next stage, set by the builder; unused by a sink
+  PipelineChannel<std::conditional_t<std::is_void_v<Out>, char, Out>, Capacity>* mOutput{nullptr};
+
+private:
+  // Runs `endOfPass` after every pass over the input rings, before backing off or returning.
+  template <typename Process, typename EndOfPass>
+  auto drain(std::uint32_t worker, PipelineMetrics& metrics, Process&& process, EndOfPass&& endOfPass) -> void
+  {
+    auto const batch = std::max(mOptions.batch, 1u);
+    auto items = std::vector<In>(batch);
+    auto spins = std::uint32_t{0};
+    while (true) {
+      // read before the pass: if every upstream thread had closed already, an empty pass means nothing is left
+      auto const closed = mInput->closed();
+      auto got = false;
+      for (std::uint32_t u = 0; u < mInput->producers(); u++) {
+        auto& ring = mInput->ring(u, worker);
+        metrics.occupancySum += ring.size();
+        metrics.occupancySamples += 1;
+        auto const n = ring.popBatch(items.data(), batch);
+        if (n == 0) {
+          continue;
+        }
+        got = true;
+        metrics.itemsIn += n;
+        metrics.batches += 1;
+        for (std::size_t i = 0; i < n; i++) {
+          process(items[i]);
+        }
+      }
+      endOfPass();
+      if (got) {
+        spins = 0;
+      } else if (closed) {
+        return;
+      } else {
+        pipelineBackoff(spins);
+      }
+    }
+  }
+
+  F mFn;
+  std::unique_ptr<PipelineChannel<In, Capacity>> mInput;
+};
+
+template <typename Head, std::size_t Capacity>
+class Pipeline {
+public:
+  Pipeline(Pipeline&&) = default;
+  ~Pipeline() { join(); }
+
+  // Starts every stage thread, pinned as requested; pinning failures (e.g. a CPU outside the allowed set) are ignored.
+  auto start() -> void
+  {
+    for (std::uint32_t i = 0; i < mSource->producers(); i++) {
+      mProducers.push_back(
+          std::make_unique<PipelineEmitter<Head, Capacity>>(*mSource, i, mBatch, mProducerMetrics[i]));
+    }
+    mStart = std::chrono::steady_clock::now();
+    for (auto& stage : mStages) {
+      auto const& options = stage->options();
+      for (std::uint32_t w = 0; w < options.threads; w++) {
+        auto& thread = mThreads.emplace_back([stage = stage.get(), w] { stage->work(w); });
+        if (!options.cpus.empty()) {
+          cpu_set_t set;
+          CPU_ZERO(&set);
+          CPU_SET(options.cpus[w % options.cpus.size()], &set);
+          pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+        }
+      }
+    }
+  }
+
+  // Emitter of external producer thread `i`; valid after start(). Every producer must close() its emitter.
+  auto producer(std::uint32_t i) noexcept -> PipelineEmitter<Head, Capacity>& { return *mProducers[i]; }
+
+  // Waits until every producer has closed and everything has flowed through the sink.
+  auto join() -> void
+  {
+    for (auto& thread : mThreads) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+    mThreads.clear();
+  }
+
+  // Per stage: items consumed, throughput from start() to the stage's last thread finishing, average input ring
+  // occupancy, average pop batch, and how often its output stalled on a full downstream stage. Call after join().
+  auto report(FILE* out) const -> void
+  {
+    std::fprintf(out, "%-16s %7s %12s %10s %10s %9s %10s\n", "stage", "threads", "items", "M items/s", "occupancy",
+                 "avg batch", "stalls");
+    for (auto const& stage : mStages) {
+      auto total = PipelineMetrics{};
+      for (auto const& m : stage->metrics()) {
+        total.itemsIn += m.itemsIn;
+        total.batches += m.batches;
+        total.stalls += m.stalls;
+        total.occupancySum += m.occupancySum;
+        total.occupancySamples += m.occupancySamples;
+        total.finished = std::max(total.finished, m.finished);
+      }
+      auto const seconds = std::chrono::duration<double>(total.finished - mStart).count();
+      auto const occupancy = total.occupancySamples == 0 ? 0.0
+                                                         : 100.0 * static_cast<double>(total.occupancySum) /
+                                                               static_cast<double>(total.occupancySamples) /
+                                                               static_cast<double>(stage->capacity());
+      auto const avgBatch =
+          total.batches == 0 ? 0.0 : static_cast<double>(total.itemsIn) / static_cast<double>(total.batches);
+      std::fprintf(out, "%-16.16s %7u %12llu %10.2f %9.1f%% %9.1f %10llu\n", stage->name().c_str(),
+                   stage->options().threads, (unsigned long long)total.itemsIn,
+                   seconds > 0 ? static_cast<double>(total.itemsIn) / seconds / 1e6 : 0.0, occupancy, avgBatch,
+                   (unsigned long long)total.stalls);
+    }
+    auto stalls = std::uint64_t{0};
+    for (auto const& m : mProducerMetrics) {
+      stalls += m.stalls;
+    }
+    std::fprintf(out, "producers: %zu, stalls %llu\n", mProducerMetrics.size(), (unsigned long long)stalls);
+  }
+
+private:
+  template <typename, typename, std::size_t>
+  friend class PipelineBuilder;
+
+  Pipeline(std::uint32_t producers, std::uint32_t batch) : mProducerMetrics(producers), mBatch(batch) {}
+
+  std::vector<std::unique_ptr<PipelineStageBase>> mStages;
+  PipelineChannel<Head, Capacity>* mSource{nullptr}; // input of the first stage
+  std::vector<PipelineMetrics> mProducerMetrics;
+  std::uint32_t mBatch;
+  std::vector<std::unique_ptr<PipelineEmitter<Head, Capacity>>> mProducers;
+  std::vector<std::thread> mThreads;
+  std::chrono::steady_clock::time_point mStart{};
+};
+
+// Assembles a Pipeline whose external producers emit Head and whose last stage so far consumes Tail.
+template <typename Head, typename Tail = Head, std::size_t Capacity = 1024>
+class PipelineBuilder {
+public:
+  // `batch` is the producers' emit batch.
+  explicit PipelineBuilder(std::uint32_t producers, std::uint32_t batch = 64)
+      : mPipeline(new Pipeline<Head, Capacity>(producers, batch)), mUpstream(producers), mOutput(&mPipeline->mSource)
+  {
+  }
+
+  // `fn(Tail&, PipelineEmitter<Out, Capacity>&)` may emit any number of items per input.
+  template <typename Out, typename F>
+  auto stage(std::string name, F fn, StageOptions options = {}) && -> PipelineBuilder<Head, Out, Capacity>
+  {
+    auto* stage = add<Out>(std::move(name), std::move(fn), std::move(options));
+    return PipelineBuilder<Head, Out, Capacity>(std::move(mPipeline), stage->options().threads, &stage->mOutput);
+  }
+
+  // `fn(Tail&)` consumes the items.
+  template <typename F>
+  auto sink(std::string name, F fn, StageOptions options = {}) && -> Pipeline<Head, Capacity>
+  {
+    add<void>(std::move(name), std::move(fn), std::move(options));
+    return std::move(*mPipeline);
+  }
+
+private:
+  template <typename, typename, std::size_t>
+  friend class PipelineBuilder;
+
+  PipelineBuilder(std::unique_ptr<Pipeline<Head, Capacity>> pipeline, std::uint32_t upstream,
+                  PipelineChannel<Tail, Capacity>** output)
+      : mPipeline(std::move(pipeline)), mUpstream(upstream), mOutput(output)
+  {
+  }
+
+  template <typename Out, typename F>
+  auto add(std::string name, F fn, StageOptions options) -> PipelineStage<Tail, Out, Capacity, F>*
+  {
+    assert(options.threads > 0);
+    auto stage = std::make_unique<PipelineStage<Tail, Out, Capacity, F>>(std::move(name), std::move(fn),
+                                                                         std::move(options), mUpstream);
+    auto* raw = stage.get();
+    *mOutput = &raw->input();
+    mPipeline->mStages.push_back(std::move(stage));
+    return raw;
+  }
+
+  std::unique_ptr<Pipeline<Head, Capacity>> mPipeline;
+  std::uint32_t mUpstream;
+  PipelineChannel<Tail, Capacity>** mOutput; // where the next stage's input goes: the producers' or a stage's output
+};
+
+#ifdef PIPELINE_MAIN_FUNC
+  #include <cstring>
+
+struct RawEvent {
+  char text[24];
+  std::chrono::steady_clock::time_point created;
+};
+
+struct Event {
+  std::uint32_t user;
+  std::uint32_t amount;
+  std::chrono::steady_clock::time_point created;
+};
+
+struct Enriched {
+  Event event;
+  std::uint32_t region;
+};
+
+auto main() -> int
+{
+  constexpr auto kProducers = 2u;
+  constexpr auto kPerProducer = 1'000'000u;
+  constexpr auto kUsers = 1024u;
+
+  auto totals = std::vector<std::uint64_t>(kUsers, 0);
+  auto emitted = std::uint64_t{0};
+  auto latencySum = 0.0;
+  auto latencyMax = 0.0;
+
+  auto pipeline =
+      PipelineBuilder<RawEvent>(kProducers)
+          .stage<Event>(
+              "parse",
+              [](RawEvent& raw, auto& out) {
+                auto user = 0u, amount = 0u;
+                std::sscanf(raw.text, "%u:%u", &user, &amount);
+                out.emit(Event{user, amount, raw.created});
+              },
+              {.threads = 2})
+          .stage<Enriched>("enrich", [](Event& e, auto& out) { out.emit(Enriched{e, e.user % 7}); }, {.cpus = {0}})
+          .stage<Enriched>("aggregate",
+                           [&](Enriched& e, auto& out) {
+                             totals[e.event.user] += e.event.amount;
+                             // forward one in 16 to the slow output stage
+                             if ((e.event.user & 15) == 0) {
+                               out.emit(e);
+                             }
+                           })
+          .sink("emit", [&](Enriched& e) {
+            auto const latency =
+                std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - e.event.created).count();
+            latencySum += latency;
+            latencyMax = std::max(latencyMax, latency);
+            emitted += 1;
+          });
+
+  pipeline.start();
+  auto producers = std::vector<std::thread>{};
+  for (auto p = 0u; p < kProducers; p++) {
+    producers.emplace_back([&, p] {
+      auto& out = pipeline.producer(p);
+      for (auto i = 0u; i < kPerProducer; i++) {
+        auto raw = RawEvent{};
+        std::snprintf(raw.text, sizeof(raw.text), "%u:%u", (i * kProducers + p) % kUsers, i % 100);
+        raw.created = std::chrono::steady_clock::now();
+        out.emit(raw);
+      }
+      out.close();
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  pipeline.join();
+
+  auto sum = std::uint64_t{0};
+  for (auto t : totals) {
+    sum += t;
+  }
+  auto expected = std::uint64_t{0};
+  for (auto i = 0u; i < kPerProducer; i++) {
+    expected += kProducers * (i % 100);
+  }
+  assert(sum == expected);
+  assert(emitted == std::uint64_t{kProducers} * kPerProducer / 16);
+  pipeline.report(stdout);
+  std::printf("sink: %llu events, latency avg %.1f us, max %.1f us\n", (unsigned long long)emitted,
+              latencySum / static_cast<double>(emitted), latencyMax);
+}
+#endif
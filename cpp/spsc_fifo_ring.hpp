@@ -1,3 +1,5 @@
+#pragma once
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <memory>
@@ -52,7 +54,40 @@ public:
         popCursor_.store(popCursor + 1, std::memory_order_release);
         return true;
     }
+    // Pushes as many of values[0, count) as fit and publishes them with a single cursor store.
+    [[nodiscard]] auto pushBatch(T const* values, size_type count) -> size_type {
+        auto pushCursor = pushCursor_.load(std::memory_order_relaxed);
+        if (free(pushCursor, popCursorCached_) < count) {
+            popCursorCached_ = popCursor_.load(std::memory_order_acquire);
+        }
+        auto n = std::min(count, free(pushCursor, popCursorCached_));
+        for (size_type i = 0; i < n; ++i) {
+            new (element(pushCursor + i)) T(values[i]);
+        }
+        pushCursor_.store(pushCursor + n, std::memory_order_release);
+        return n;
+    }
+    // Pops up to `count` values into values[0, count) and releases their slots with a single cursor store.
+    [[nodiscard]] auto popBatch(T* values, size_type count) -> size_type {
+        auto popCursor = popCursor_.load(std::memory_order_relaxed);
+        if (pushCursorCached_ - popCursor < count) {
+            pushCursorCached_ = pushCursor_.load(std::memory_order_acquire);
+        }
+        auto n = std::min(count, pushCursorCached_ - popCursor);
+        for (size_type i = 0; i < n; ++i) {
+            values[i] = std::move(*element(popCursor + i));
+            element(popCursor + i)->~T();
+        }
+        popCursor_.store(popCursor + n, std::memory_order_release);
+        return n;
+    }
+    static constexpr auto capacity() noexcept {
+        return mask_ + 1;
+    }
 private:
+    auto free(size_type pushCursor, size_type popCursor) const noexcept {
+        return mask_ + 1 - (pushCursor - popCursor);
+    }
     auto full(size_type pushCursor, size_type popCursor) const noexcept {
         return (pushCursor - popCursor) == mask_ + 1;
     }
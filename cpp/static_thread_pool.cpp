@@ -1,23 +1,31 @@
+#pragma once
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <format>
 #include <iostream>
+#include <latch>
 #include <mutex>
 #include <vector>
 
+#include "inplace_function.hpp"
 #include "intr_queue.cpp"
+#include "manual_lifetime.hpp"
+#include "perf_counters.hpp"
+#include "task_base.hpp"
+#include "trace.hpp"
 
-struct TaskBase {
-  TaskBase* next;
-  void (*run)(TaskBase* task, std::uint32_t tid) noexcept;
+// When another worker may run a task queued with an affinity key (see StaticThreadPool::enqueue(task, key)).
+struct AffinityOptions {
+  std::chrono::microseconds stealDelay{100}; // the home worker has not started one of its affinity tasks for this long
+  std::uint32_t overloadThreshold{256};      // or has more affinity tasks queued than this
 };
 
 class StaticThreadPool {
 public:
-  StaticThreadPool(std::size_t n = std::thread::hardware_concurrency())
-      : mThreadCount(n), mThreadStates(n), mNextThread(0)
+  StaticThreadPool(std::size_t n = std::thread::hardware_concurrency(), AffinityOptions affinity = {})
+      : mThreadCount(n), mThreadStates(n), mNextThread(0), mAffinity(affinity)
   {
     assert(n > 0);
     mThreads.reserve(n);
@@ -39,6 +47,7 @@ public:
   }
   auto enqueue(TaskBase* task) noexcept -> void
   {
+    auto perf = PerfScope{kPerfEnqueue};
     std::uint32_t const threadCount = mThreads.size();
     std::uint32_t const startIdx = mNextThread.fetch_add(1, std::memory_order_relaxed) % threadCount;
     for (std::uint32_t i = 0; i < threadCount; i++) {
@@ -49,6 +58,59 @@ public:
     }
     mThreadStates[startIdx].push(task);
   }
+  // Queues `task` on worker `tid`; idle workers may still steal it.
+  auto enqueueOn(TaskBase* task, std::uint32_t tid) noexcept -> void { mThreadStates[tid % mThreadCount].push(task); }
+
+  // Queues `task` on the home worker of `affinityKey`, so tasks for one key (shard, partition, connection) run on one
+  // worker and find their data in its cache. Other workers leave such tasks alone unless the home worker falls behind,
+  // see AffinityOptions.
+  auto enqueue(TaskBase* task, std::uint64_t affinityKey) noexcept -> void
+  {
+    auto perf = PerfScope{kPerfEnqueue};
+    auto const home = homeWorker(affinityKey);
+    if (mThreadStates[home].pushHome(task, mAffinity) && mThreadCount > 1) {
+      // the neighbour keeps an eye on the home queue: it rescans after stealDelay whenever it has nothing else to do
+      mThreadStates[(home + 1) % mThreadCount].wakeToSteal();
+    }
+  }
+
+  auto homeWorker(std::uint64_t affinityKey) const noexcept -> std::uint32_t
+  {
+    // Fibonacci hashing spreads consecutive keys, the multiply-shift maps onto [0, n) without a division
+    auto const hash = (affinityKey * 0x9E3779B97F4A7C15ull) >> 32;
+    return static_cast<std::uint32_t>((hash * mThreadCount) >> 32);
+  }
+
+  // Constructs T{args...} in every slot of [first, last) using all workers and waits for them. The range is cut at
+  // page boundaries (relative to `first`) into one chunk per worker queue, so with first-touch NUMA placement each
+  // page lands on the node of the worker that built it. Blocks the caller: call it from outside the pool.
+  template <typename T, typename... Args>
+  auto parallelConstruct(T* first, T* last, Args const&... args) -> void
+  {
+    static_assert(std::is_nothrow_constructible_v<T, Args const&...>, "workers cannot propagate exceptions");
+    constexpr auto kPageSize = std::size_t{4096};
+    auto const count = static_cast<std::size_t>(last - first);
+    auto const perPage = std::max<std::size_t>(1, kPageSize / sizeof(T));
+    auto const pages = (count + perPage - 1) / perPage;
+    auto const chunks = std::min<std::size_t>(mThreadCount, pages);
+    if (chunks == 0) {
+      return;
+    }
+    auto construct = [&](std::size_t begin, std::size_t end) { constructRange(first + begin, first + end, args...); };
+    auto done = std::latch{static_cast<std::ptrdiff_t>(chunks)};
+    auto tasks = ManualLifetimeBuffer<InplaceTask<>>(chunks);
+    for (std::size_t k = 0; k < chunks; k++) {
+      auto const begin = std::min(count, pages * k / chunks * perPage);
+      auto const end = std::min(count, pages * (k + 1) / chunks * perPage);
+      auto& task = tasks.construct(k, [&construct, &done, begin, end] {
+        construct(begin, end);
+        done.count_down();
+      });
+      enqueueOn(&task, static_cast<std::uint32_t>(k));
+    }
+    done.wait();
+    tasks.destroyRange(0, chunks);
+  }
   auto requestStop() noexcept -> void
   {
     for (auto& state : mThreadStates) {
@@ -57,8 +119,12 @@ public:
   }
 
 private:
+  // Two queues per worker: mQueue for plain tasks, which any worker takes, and mHome for affinity tasks, which only
+  // the owner takes unless trySteal() allows it.
   class ThreadState {
   public:
+    using Clock = std::chrono::steady_clock;
+
     auto tryPop() -> TaskBase*
     {
       auto lk = std::unique_lock(mMt, std::try_to_lock);
@@ -67,16 +133,55 @@ private:
       }
       return mQueue.popFront();
     }
-    auto pop() -> TaskBase*
+    // Owner only.
+    auto tryPopHome() -> TaskBase*
+    {
+      auto lk = std::unique_lock(mMt, std::try_to_lock);
+      if (!lk.owns_lock() || mHome.empty()) {
+        return nullptr;
+      }
+      return popHomeLocked();
+    }
+    // Another worker takes the oldest affinity task, if the owner is overloaded or has not taken one for a while.
+    auto trySteal(AffinityOptions const& options) -> TaskBase*
+    {
+      auto lk = std::unique_lock(mMt, std::try_to_lock);
+      if (!lk.owns_lock() || mHome.empty()) {
+        return nullptr;
+      }
+      if (mHomeSize.load(std::memory_order_relaxed) <= options.overloadThreshold &&
+          Clock::now() - mHomeProgress < options.stealDelay) {
+        return nullptr;
+      }
+      return popHomeLocked();
+    }
+    // Waits for a task of this worker, affinity tasks first. Returns nullptr with `stopped` set once stop is requested
+    // and both queues are empty; also returns nullptr when `wakeAfter` (if non-zero) expires or wakeToSteal() is
+    // called, so the caller can look for tasks to steal.
+    auto pop(Clock::duration wakeAfter, bool& stopped) -> TaskBase*
     {
       auto lk = std::unique_lock(mMt);
-      while (mQueue.empty()) {
+      while (mQueue.empty() && mHome.empty()) {
         if (mStopRequested) {
+          stopped = true;
+          return nullptr;
+        }
+        if (std::exchange(mWakeToSteal, false)) {
+          return nullptr;
+        }
+        mSleeping = true;
+        auto timedOut = false;
+        if (wakeAfter == Clock::duration::zero()) {
+          mCv.wait(lk);
+        } else {
+          timedOut = mCv.wait_for(lk, wakeAfter) == std::cv_status::timeout;
+        }
+        mSleeping = false;
+        if (timedOut && mQueue.empty() && mHome.empty()) {
           return nullptr;
         }
-        mCv.wait(lk);
       }
-      return mQueue.popFront();
+      return mHome.empty() ? mQueue.popFront() : popHomeLocked();
     }
     auto tryPush(TaskBase* task) -> bool
     {
@@ -84,7 +189,7 @@ private:
       if (!lk.owns_lock()) {
         return false;
       }
-      auto const wasEmpty = mQueue.empty();
+      auto const wasEmpty = mQueue.empty() && mHome.empty();
       mQueue.pushBack(task);
       if (wasEmpty) {
         mCv.notify_one();
@@ -94,12 +199,38 @@ private:
     auto push(TaskBase* task) -> void
     {
       auto lk = std::unique_lock(mMt);
-      auto const wasEmpty = mQueue.empty();
+      auto const wasEmpty = mQueue.empty() && mHome.empty();
       mQueue.pushBack(task);
       if (wasEmpty) {
         mCv.notify_one();
       }
     }
+    // Returns true when another worker should be woken to watch this queue: the owner is busy and the task may have
+    // to wait, or the queue has just become overloaded.
+    auto pushHome(TaskBase* task, AffinityOptions const& options) -> bool
+    {
+      auto lk = std::unique_lock(mMt);
+      auto const wasEmpty = mQueue.empty() && mHome.empty();
+      auto const wasHomeEmpty = mHome.empty();
+      if (wasHomeEmpty) {
+        // the steal delay counts from when the owner had something to do
+        mHomeProgress = Clock::now();
+      }
+      mHome.pushBack(task);
+      auto const size = mHomeSize.load(std::memory_order_relaxed) + 1;
+      mHomeSize.store(size, std::memory_order_relaxed);
+      if (wasEmpty) {
+        mCv.notify_one();
+      }
+      return (wasHomeEmpty && !mSleeping) || size == options.overloadThreshold + 1;
+    }
+    auto homeSize() const noexcept -> std::uint32_t { return mHomeSize.load(std::memory_order_relaxed); }
+    auto wakeToSteal() -> void
+    {
+      auto lk = std::unique_lock(mMt);
+      mWakeToSteal = true;
+      mCv.notify_one();
+    }
     auto requestStop() -> void
     {
       auto lk = std::unique_lock(mMt);
@@ -108,33 +239,76 @@ private:
     }
 
   private:
+    auto popHomeLocked() -> TaskBase*
+    {
+      mHomeSize.store(mHomeSize.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+      mHomeProgress = Clock::now();
+      return mHome.popFront();
+    }
+
     std::mutex mMt;
     std::condition_variable mCv;
     Queue<&TaskBase::next> mQueue;
+    Queue<&TaskBase::next> mHome;
+    std::atomic_uint32_t mHomeSize{0}; // written under mMt, read without it to decide how long to sleep
+    Clock::time_point mHomeProgress{};
     bool mStopRequested = false;
+    bool mWakeToSteal = false;
+    bool mSleeping = false; // the owner waits in pop() and will see new tasks itself
   };
 
+  // Whether another worker has affinity tasks that may become stealable while this one sleeps.
+  auto affinityQueuedElsewhere(std::uint32_t tid) const noexcept -> bool
+  {
+    for (std::uint32_t i = 0; i < mThreadCount; i++) {
+      if (i != tid && mThreadStates[i].homeSize() != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   auto run(std::uint32_t tid) noexcept -> void
   {
     assert(tid < mThreadCount);
     while (true) {
       TaskBase* task = nullptr;
       auto queueIdx = tid;
-      while (true) {
-        task = mThreadStates[queueIdx].tryPop();
-        if (task != nullptr) {
-          break;
+      {
+        // the non-blocking scan only, time spent waiting for work is not a queue cost
+        auto perf = PerfScope{kPerfDequeue};
+        task = mThreadStates[tid].tryPopHome();
+        while (task == nullptr) {
+          task = mThreadStates[queueIdx].tryPop();
+          if (task != nullptr) {
+            break;
+          }
+          queueIdx = (queueIdx + 1) % mThreadCount;
+          if (queueIdx == tid) {
+            break;
+          }
         }
-        queueIdx = (queueIdx + 1) % mThreadCount;
-        if (queueIdx == tid) {
-          break;
+        // other workers' affinity tasks come last, and only those their owner is not getting to
+        for (std::uint32_t i = 1; task == nullptr && i < mThreadCount; i++) {
+          queueIdx = (tid + i) % mThreadCount;
+          task = mThreadStates[queueIdx].trySteal(mAffinity);
         }
       }
       if (task == nullptr) {
-        if (task = mThreadStates[tid].pop(); task == nullptr) {
-          return;
+        queueIdx = tid;
+        auto const wakeAfter = affinityQueuedElsewhere(tid) ? ThreadState::Clock::duration(mAffinity.stealDelay)
+                                                            : ThreadState::Clock::duration::zero();
+        auto stopped = false;
+        if (task = mThreadStates[tid].pop(wakeAfter, stopped); task == nullptr) {
+          if (stopped) {
+            return;
+          }
+          continue;
         }
       }
+      // payload: the queue the task came from, differs from tid when it was stolen
+      auto span = TraceSpan{kTraceTask, queueIdx};
+      auto perf = PerfScope{task->run};
       task->run(task, tid);
     }
   }
@@ -147,10 +321,15 @@ private:
   }
 
 private:
+  static constexpr auto kTraceTask = TraceSite{"task", "StaticThreadPool"};
+  static constexpr auto kPerfEnqueue = TraceSite{"enqueue", "StaticThreadPool"};
+  static constexpr auto kPerfDequeue = TraceSite{"dequeue", "StaticThreadPool"};
+
   std::vector<std::thread> mThreads;
   std::vector<ThreadState> mThreadStates;
   std::uint32_t mThreadCount;
   std::atomic_uint32_t mNextThread;
+  AffinityOptions mAffinity;
 };
 
 #ifdef POOL_MAIN_FUNC
@@ -225,6 +404,57 @@ auto main() -> int
   assert(cnt.load() == 1'000'000);
   std::cout << std::format(
       "{}\n", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - now));
+
+  // per-partition aggregation: every partition's tasks carry its id as affinity key
+  constexpr auto kPartitions = 64;
+  constexpr auto kPerPartition = 10'000;
+  struct alignas(64) Partition {
+    std::uint64_t sum{0};
+    std::uint64_t onHome{0};
+  };
+  struct AggregateTask : TaskBase {
+    AggregateTask() : TaskBase{nullptr, &AggregateTask::run} {}
+    static auto run(TaskBase* task, std::uint32_t tid) noexcept -> void
+    {
+      auto* t = static_cast<AggregateTask*>(task);
+      t->partition->sum += t->value;
+      t->partition->onHome += tid == t->home ? 1 : 0;
+      t->done->count_down();
+    }
+    Partition* partition{nullptr};
+    std::uint64_t value{0};
+    std::uint32_t home{0};
+    std::latch* done{nullptr};
+  };
+  auto partitions = std::vector<Partition>(kPartitions);
+  auto aggregates = std::vector<AggregateTask>(kPartitions * kPerPartition);
+  auto done = std::latch{kPartitions * kPerPartition};
+  now = std::chrono::high_resolution_clock::now();
+  {
+    // stealing disabled, so the partition sums need no synchronization
+    auto pool = StaticThreadPool(kThreadCount, AffinityOptions{std::chrono::hours(1), UINT32_MAX});
+    for (int i = 0; i < kPartitions * kPerPartition; i++) {
+      auto& t = aggregates[i];
+      auto const key = static_cast<std::uint64_t>(i % kPartitions);
+      t.partition = &partitions[key];
+      t.value = static_cast<std::uint64_t>(i);
+      t.home = pool.homeWorker(key);
+      t.done = &done;
+      pool.enqueue(&t, key);
+    }
+    done.wait();
+  }
+  auto onHome = std::uint64_t{0};
+  auto total = std::uint64_t{0};
+  for (auto const& partition : partitions) {
+    onHome += partition.onHome;
+    total += partition.sum;
+  }
+  assert(onHome == aggregates.size());
+  assert(total == aggregates.size() * (aggregates.size() - 1) / 2);
+  std::cout << std::format(
+      "affinity: {} tasks on their home worker, {}\n", onHome,
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - now));
   return 0;
 }
 #endif
\ No newline at end of file
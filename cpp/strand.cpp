@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+#include "atomic_queue.cpp"
+#include "intr_queue.cpp"
+#include "task_base.hpp"
+
+// Serial executor on top of a thread pool: tasks posted to one strand never run concurrently and run in posting order
+// per posting thread, without a mutex. Posting pushes onto an intrusive lock-free stack; the poster that flips
+// `scheduled` from false to true hands the strand's single drain task to the pool. The drain runs at most `batch`
+// tasks, then either goes back to the end of its worker's queue (more work is waiting) or clears `scheduled`.
+//
+// The drain task touches the strand after the last posted task has returned, so destroy a strand only once its pool
+// has stopped (or is otherwise known to hold no drain of it).
+template <typename Pool>
+class Strand {
+public:
+  explicit Strand(Pool& pool, std::uint32_t batch = 64) noexcept : mPool(pool), mBatch(batch) {}
+  Strand(Strand const&) = delete;
+  Strand& operator=(Strand const&) = delete;
+
+  auto post(TaskBase* task) noexcept -> void
+  {
+    mIncoming.pushFront(task);
+    // pairs with the fence in drain(): either the drain sees this task, or this exchange sees scheduled == false
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!mScheduled.exchange(true, std::memory_order_acquire)) {
+      mPool.enqueue(&mDrain);
+    }
+  }
+
+private:
+  struct DrainTask : TaskBase {
+    explicit DrainTask(Strand* s) noexcept : TaskBase{nullptr, &DrainTask::run}, strand(s) {}
+    static auto run(TaskBase* task, std::uint32_t tid) noexcept -> void
+    {
+      static_cast<DrainTask*>(task)->strand->drain(tid);
+    }
+
+    Strand* strand;
+  };
+
+  auto drain(std::uint32_t tid) noexcept -> void
+  {
+    for (std::uint32_t n = 0; n < mBatch; n++) {
+      if (mPending.empty()) {
+        // the stack holds the newest task first, popAll() hands it back oldest first
+        mPending = mIncoming.popAll();
+        if (mPending.empty()) {
+          break;
+        }
+      }
+      auto* task = mPending.popFront();
+      task->run(task, tid);
+    }
+    if (!mPending.empty() || !mIncoming.empty()) {
+      reschedule(tid);
+      return;
+    }
+    mScheduled.store(false, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // a post that raced with the store above may have seen scheduled == true and left its task to us
+    if (!mIncoming.empty() && !mScheduled.exchange(true, std::memory_order_acquire)) {
+      reschedule(tid);
+    }
+  }
+
+  // Back to the end of the same worker's queue when the pool allows it: other tasks get their turn, and the guarded
+  // state stays in this worker's cache.
+  auto reschedule(std::uint32_t tid) noexcept -> void
+  {
+    if constexpr (requires { mPool.enqueueOn(&mDrain, tid); }) {
+      mPool.enqueueOn(&mDrain, tid);
+    } else {
+      mPool.enqueue(&mDrain);
+    }
+  }
+
+  Pool& mPool;
+  std::uint32_t mBatch;
+  DrainTask mDrain{this};
+  AtomicQueue<&TaskBase::next> mIncoming;
+  Queue<&TaskBase::next> mPending; // only touched by the running drain
+  std::atomic_bool mScheduled{false};
+};
+
+#ifdef STRAND_MAIN_FUNC
+  #include "static_thread_pool.cpp"
+  #include <cassert>
+  #include <chrono>
+  #include <cstdio>
+  #include <thread>
+  #include <vector>
+
+struct Account {
+  std::uint64_t balance{0};
+  std::uint64_t lastSeq[4]{};
+  std::atomic_bool inside{false};
+};
+
+struct Deposit : TaskBase {
+  Deposit() : TaskBase{nullptr, &Deposit::run} {}
+  static auto run(TaskBase* task, std::uint32_t) noexcept -> void
+  {
+    auto* d = static_cast<Deposit*>(task);
+    auto& account = *d->account;
+    assert(!account.inside.exchange(true, std::memory_order_relaxed) && "strand tasks never overlap");
+    // tasks from one producer arrive in posting order
+    assert(account.lastSeq[d->producer] < d->seq);
+    account.lastSeq[d->producer] = d->seq;
+    account.balance += 1;
+    account.inside.store(false, std::memory_order_relaxed);
+    d->done->fetch_add(1, std::memory_order_release);
+    d->done->notify_one();
+  }
+
+  Account* account{nullptr};
+  std::uint32_t producer{0};
+  std::uint64_t seq{0};
+  std::atomic_uint64_t* done{nullptr};
+};
+
+auto main() -> int
+{
+  constexpr auto kProducers = 4;
+  constexpr auto kAccounts = 16;
+  constexpr auto kPerProducer = 200'000;
+  auto accounts = std::vector<Account>(kAccounts);
+  auto strands = std::vector<std::unique_ptr<Strand<StaticThreadPool>>>{};
+  // declared after the strands so it is joined before they are destroyed
+  auto pool = StaticThreadPool(4);
+  for (int i = 0; i < kAccounts; i++) {
+    strands.push_back(std::make_unique<Strand<StaticThreadPool>>(pool));
+  }
+  auto deposits = std::vector<Deposit>(kProducers * kPerProducer);
+  auto done = std::atomic_uint64_t{0};
+
+  auto const start = std::chrono::steady_clock::now();
+  auto producers = std::vector<std::thread>{};
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&, p] {
+      for (int i = 0; i < kPerProducer; i++) {
+        auto& d = deposits[p * kPerProducer + i];
+        d.account = &accounts[i % kAccounts];
+        d.producer = static_cast<std::uint32_t>(p);
+        d.seq = static_cast<std::uint64_t>(i) + 1;
+        d.done = &done;
+        strands[i % kAccounts]->post(&d);
+      }
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  for (auto seen = done.load(std::memory_order_acquire); seen != deposits.size();
+       seen = done.load(std::memory_order_acquire)) {
+    done.wait(seen);
+  }
+  auto const elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  auto total = std::uint64_t{0};
+  for (auto& account : accounts) {
+    total += account.balance;
+  }
+  assert(total == deposits.size());
+  std::printf("%zu strand tasks in %.1f ms, %.1f M/s\n", deposits.size(), elapsed,
+              static_cast<double>(deposits.size()) / elapsed / 1e3);
+}
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+#include <cstdint>
+
+// Intrusive unit of work for the thread pools: `next` links it into their queues, `run` is called once with the id of
+// the worker that picked it up.
+struct TaskBase {
+  TaskBase* next;
+  void (*run)(TaskBase* task, std::uint32_t tid) noexcept;
+};